@@ -72,51 +72,240 @@ lf_lifo_init(struct lf_lifo *head)
 	head->next = NULL;
 }
 
+/**
+ * Try to push an element with a single CAS.
+ * @retval true the element is pushed
+ * @retval false the stack has been changed concurrently
+ */
+static inline bool
+lf_lifo_try_push(struct lf_lifo *head, void *elem)
+{
+	assert(lf_lifo(elem) == elem); /* Aligned address. */
+	void *tail = head->next;
+	lf_lifo(elem)->next = tail;
+	/*
+	 * Sic: add 1 thus let ABA value overflow, *then*
+	 * coerce to unsigned short
+	 */
+	void *newhead = (char *) elem + aba_value((char *) tail + 1);
+	return pm_atomic_compare_exchange_weak(&head->next, &tail, newhead);
+}
+
 static inline struct lf_lifo *
 lf_lifo_push(struct lf_lifo *head, void *elem)
 {
-	assert(lf_lifo(elem) == elem); /* Aligned address. */
+	while (!lf_lifo_try_push(head, elem))
+		;
+	return head;
+}
+
+/**
+ * Try to pop an element with a single CAS.
+ * @retval true the element is popped to @a elem, or the stack
+ *         is empty and @a elem is NULL
+ * @retval false the stack has been changed concurrently
+ */
+static inline bool
+lf_lifo_try_pop(struct lf_lifo *head, void **elem)
+{
+	void *tail = head->next;
+	*elem = lf_lifo(tail);
+	if (*elem == NULL)
+		return true;
+	/*
+	 * Discard the old tail's aba value, then save
+	 * the old head's value in the tail.
+	 * This way head's aba value grows monotonically
+	 * regardless of the exact sequence of push/pop
+	 * operations.
+	 */
+	void *newhead = ((char *) lf_lifo(lf_lifo(*elem)->next) +
+			 aba_value(tail));
+	return pm_atomic_compare_exchange_weak(&head->next, &tail, newhead);
+}
+
+static inline void *
+lf_lifo_pop(struct lf_lifo *head)
+{
+	void *elem;
+	while (!lf_lifo_try_pop(head, &elem))
+		;
+	return elem;
+}
+
+/**
+ * Push a chain of elements at once. Elements from @a first to
+ * @a last must be linked with lf_lifo(elem)->next.
+ */
+static inline struct lf_lifo *
+lf_lifo_push_chain(struct lf_lifo *head, void *first, void *last)
+{
+	assert(lf_lifo(first) == first); /* Aligned address. */
+	assert(lf_lifo(last) == last);
 	do {
 		void *tail = head->next;
-		lf_lifo(elem)->next = tail;
-		/*
-		 * Sic: add 1 thus let ABA value overflow, *then*
-		 * coerce to unsigned short
-		 */
-		void *newhead = (char *) elem + aba_value((char *) tail + 1);
+		lf_lifo(last)->next = tail;
+		void *newhead = (char *) first + aba_value((char *) tail + 1);
 		if (pm_atomic_compare_exchange_weak(&head->next, &tail, newhead))
 			return head;
 	} while (true);
 }
 
+/**
+ * Detach all elements at once. Returns the top element or NULL,
+ * the rest of elements are reachable with lf_lifo(elem)->next.
+ */
 static inline void *
-lf_lifo_pop(struct lf_lifo *head)
+lf_lifo_pop_all(struct lf_lifo *head)
 {
 	do {
 		void *tail = head->next;
 		struct lf_lifo *elem = lf_lifo(tail);
 		if (elem == NULL)
 			return NULL;
-		/*
-		 * Discard the old tail's aba value, then save
-		 * the old head's value in the tail.
-		 * This way head's aba value grows monotonically
-		 * regardless of the exact sequence of push/pop
-		 * operations.
-		 */
-		void *newhead = ((char *) lf_lifo(elem->next) +
-				 aba_value(tail));
+		/* Keep the aba value, like lf_lifo_pop() does. */
+		void *newhead = (char *) NULL + aba_value(tail);
 		if (pm_atomic_compare_exchange_weak(&head->next, &tail, newhead))
 			return elem;
 	} while (true);
 }
 
+/**
+ * Pop up to @a count elements. Elements are popped one by one,
+ * so that the stack is never detached as a whole and concurrent
+ * pops still see the elements which are not taken.
+ * @return the number of elements stored in @a elems.
+ */
+static inline size_t
+lf_lifo_pop_n(struct lf_lifo *head, void **elems, size_t count)
+{
+	size_t n = 0;
+	while (n < count && (elems[n] = lf_lifo_pop(head)) != NULL)
+		n++;
+	return n;
+}
+
 static inline bool
 lf_lifo_is_empty(struct lf_lifo *head)
 {
 	return head->next == NULL;
 }
 
+enum {
+	/** The number of exchange slots of lf_lifo_elim. */
+	LF_LIFO_ELIM_SLOTS = 16,
+	/** Max number of spins waiting for a pair in a slot. */
+	LF_LIFO_ELIM_SPIN_MAX = 1024,
+};
+
+/** An exchange slot of lf_lifo_elim, one per cache line. */
+struct lf_lifo_elim_slot {
+	/** An element offered by a push, NULL if the slot is free. */
+	void *elem;
+	char pad[64 - sizeof(void *)];
+};
+
+/**
+ * lf_lifo with an elimination array. A push or pop which fails
+ * to CAS the stack head under contention tries to meet an
+ * opposite operation in a randomly chosen exchange slot: a push
+ * offers its element there for a while, a pop takes an offered
+ * element, and neither touches the stack. The number of slots
+ * tried and the offer time grow exponentially with failures.
+ * See D. Hendler, N. Shavit, L. Yerushalmi, "A Scalable
+ * Lock-free Stack Algorithm", 2004.
+ *
+ * Elements offered in slots are not in the stack, so
+ * lf_lifo_is_empty(&stack->lifo) may be true for a moment
+ * while a push is in progress.
+ */
+struct lf_lifo_elim {
+	struct lf_lifo lifo;
+	struct lf_lifo_elim_slot slots[LF_LIFO_ELIM_SLOTS];
+};
+
+static inline void
+lf_lifo_elim_init(struct lf_lifo_elim *stack)
+{
+	lf_lifo_init(&stack->lifo);
+	int i;
+	for (i = 0; i < LF_LIFO_ELIM_SLOTS; i++)
+		stack->slots[i].elem = NULL;
+}
+
+/**
+ * A per-thread xorshift32 generator, seeded with the address
+ * of its thread local state, which differs between threads.
+ */
+static inline uint32_t
+lf_lifo_elim_rand(void)
+{
+	static __thread uint32_t state;
+	uint32_t x = state;
+	if (x == 0)
+		x = ((uint32_t)((uintptr_t)&state >> 4) * 2654435761u) | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	state = x;
+	return x;
+}
+
+/** Pick a random slot among the first @a range ones. */
+static inline struct lf_lifo_elim_slot *
+lf_lifo_elim_slot(struct lf_lifo_elim *stack, unsigned range)
+{
+	return &stack->slots[lf_lifo_elim_rand() % range];
+}
+
+static inline unsigned
+lf_lifo_elim_range(unsigned attempt)
+{
+	unsigned range = 1u << (attempt < 4 ? attempt : 4);
+	unsigned max = LF_LIFO_ELIM_SLOTS;
+	return range < max ? range : max;
+}
+
+static inline void
+lf_lifo_elim_push(struct lf_lifo_elim *stack, void *elem)
+{
+	unsigned attempt;
+	for (attempt = 0; !lf_lifo_try_push(&stack->lifo, elem); attempt++) {
+		struct lf_lifo_elim_slot *slot = lf_lifo_elim_slot(
+			stack, lf_lifo_elim_range(attempt));
+		void *expected = NULL;
+		if (!pm_atomic_compare_exchange_strong(&slot->elem, &expected,
+						       elem))
+			continue;
+		unsigned spin = 16u << (attempt < 6 ? attempt : 6);
+		if (spin > LF_LIFO_ELIM_SPIN_MAX)
+			spin = LF_LIFO_ELIM_SPIN_MAX;
+		while (spin-- > 0 && pm_atomic_load(&slot->elem) == elem)
+			;
+		/* Withdraw the offer unless a pop has taken it. */
+		expected = elem;
+		if (!pm_atomic_compare_exchange_strong(&slot->elem, &expected,
+						       NULL))
+			return;
+	}
+}
+
+static inline void *
+lf_lifo_elim_pop(struct lf_lifo_elim *stack)
+{
+	void *elem;
+	unsigned attempt;
+	for (attempt = 0; !lf_lifo_try_pop(&stack->lifo, &elem); attempt++) {
+		struct lf_lifo_elim_slot *slot = lf_lifo_elim_slot(
+			stack, lf_lifo_elim_range(attempt));
+		elem = pm_atomic_load(&slot->elem);
+		if (elem != NULL &&
+		    pm_atomic_compare_exchange_strong(&slot->elem, &elem, NULL))
+			return elem;
+	}
+	return elem;
+}
+
 #if defined(__cplusplus)
 } /* extern "C" */
 #endif /* defined(__cplusplus) */
@@ -0,0 +1,186 @@
+#ifndef INCLUDES_TARANTOOL_LF_LIFO2_H
+#define INCLUDES_TARANTOOL_LF_LIFO2_H
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pmatomic.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * A lock-free LIFO like lf_lifo, but with the ABA counter kept
+ * in a separate word next to the top pointer. Both words are
+ * changed with one double-width compare-and-swap (cmpxchg16b on
+ * x86_64), so elements only need to be pointer-aligned and the
+ * counter doesn't wrap in practice (64 bits on 64-bit targets).
+ *
+ * The first word of an element is used as the link. As with
+ * lf_lifo, lf_lifo2_pop() may read the link of an element which
+ * is being popped by another thread, so the memory of elements
+ * must stay mapped while the stack is in use. It may be reused
+ * for anything else though, e.g. for objects of a free list.
+ */
+struct lf_lifo2 {
+	/** The top element, NULL if the stack is empty. */
+	void *top;
+	/** Incremented on each change of the top. */
+	uintptr_t tag;
+} __attribute__((aligned(2 * sizeof(void *))));
+
+/** The link stored in the first word of an element. */
+struct lf_lifo2_link {
+	void *next;
+};
+
+static inline void
+lf_lifo2_init(struct lf_lifo2 *head)
+{
+	head->top = NULL;
+	head->tag = 0;
+}
+
+/**
+ * Replace the stack head with @a new if it is equal to @a old.
+ * Otherwise, @a old is set to the current head.
+ */
+static inline bool
+lf_lifo2_cas(struct lf_lifo2 *head, struct lf_lifo2 *old,
+	     const struct lf_lifo2 *new_head)
+{
+#if defined(__x86_64__)
+	bool success;
+	/*
+	 * GCC only inlines 16-byte __sync builtins with -mcx16,
+	 * which the users of the header would have to enable.
+	 */
+	__asm__ __volatile__("lock cmpxchg16b %1\n\tsetz %0"
+			     : "=q"(success), "+m"(*head),
+			       "+a"(old->top), "+d"(old->tag)
+			     : "b"(new_head->top), "c"(new_head->tag)
+			     : "memory", "cc");
+	return success;
+#elif defined(__SIZEOF_INT128__) && __SIZEOF_POINTER__ == 8
+	unsigned __int128 expected, desired, prev;
+	__builtin_memcpy(&expected, old, sizeof(expected));
+	__builtin_memcpy(&desired, new_head, sizeof(desired));
+	prev = __sync_val_compare_and_swap((unsigned __int128 *)head,
+					   expected, desired);
+	__builtin_memcpy(old, &prev, sizeof(prev));
+	return prev == expected;
+#else
+	/* Two 32-bit words are changed with a 64-bit CAS. */
+	uint64_t expected, desired;
+	__builtin_memcpy(&expected, old, sizeof(expected));
+	__builtin_memcpy(&desired, new_head, sizeof(desired));
+	bool success = pm_atomic_compare_exchange_strong(
+		(uint64_t *)head, &expected, desired);
+	__builtin_memcpy(old, &expected, sizeof(expected));
+	return success;
+#endif
+}
+
+/** Read the head. The words are read separately, see lf_lifo2_cas(). */
+static inline void
+lf_lifo2_load(struct lf_lifo2 *head, struct lf_lifo2 *value)
+{
+	value->tag = pm_atomic_load_explicit(&head->tag,
+					     pm_memory_order_acquire);
+	value->top = pm_atomic_load_explicit(&head->top,
+					     pm_memory_order_acquire);
+}
+
+static inline struct lf_lifo2 *
+lf_lifo2_push(struct lf_lifo2 *head, void *elem)
+{
+	assert((uintptr_t)elem % sizeof(void *) == 0);
+	struct lf_lifo2 old, new_head;
+	lf_lifo2_load(head, &old);
+	new_head.top = elem;
+	do {
+		((struct lf_lifo2_link *)elem)->next = old.top;
+		new_head.tag = old.tag + 1;
+	} while (!lf_lifo2_cas(head, &old, &new_head));
+	return head;
+}
+
+static inline void *
+lf_lifo2_pop(struct lf_lifo2 *head)
+{
+	struct lf_lifo2 old, new_head;
+	lf_lifo2_load(head, &old);
+	do {
+		if (old.top == NULL)
+			return NULL;
+		/*
+		 * The element may be popped and pushed again
+		 * concurrently, then the link is stale, but the
+		 * tag has changed and the CAS fails.
+		 */
+		new_head.top = ((struct lf_lifo2_link *)old.top)->next;
+		new_head.tag = old.tag + 1;
+	} while (!lf_lifo2_cas(head, &old, &new_head));
+	return old.top;
+}
+
+/**
+ * Detach all elements at once. Returns the top element or NULL,
+ * the rest of elements are linked through their first word.
+ */
+static inline void *
+lf_lifo2_pop_all(struct lf_lifo2 *head)
+{
+	struct lf_lifo2 old, new_head;
+	lf_lifo2_load(head, &old);
+	new_head.top = NULL;
+	do {
+		if (old.top == NULL)
+			return NULL;
+		new_head.tag = old.tag + 1;
+	} while (!lf_lifo2_cas(head, &old, &new_head));
+	return old.top;
+}
+
+static inline bool
+lf_lifo2_is_empty(struct lf_lifo2 *head)
+{
+	return pm_atomic_load(&head->top) == NULL;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* INCLUDES_TARANTOOL_LF_LIFO2_H */
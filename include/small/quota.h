@@ -36,38 +36,148 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/types.h> /* ssize_t */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
 #include <pmatomic.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-#define QUOTA_UNIT_SIZE 1024ULL
+/**
+ * Quota granularity. Sizes are rounded up to a multiple of it,
+ * which is one cache line, so that small leases aren't inflated.
+ */
+#define QUOTA_UNIT_SIZE 64ULL
+
+struct quota;
+struct quota_shard;
+
+/** Which watermark a quota usage crossed. */
+enum quota_watermark {
+	/** The usage went down to the low watermark. */
+	QUOTA_WATERMARK_LOW,
+	/** The usage went up to the high watermark. */
+	QUOTA_WATERMARK_HIGH,
+};
 
-static const size_t QUOTA_MAX = QUOTA_UNIT_SIZE * UINT32_MAX > SIZE_MAX ?
-				SIZE_MAX - QUOTA_UNIT_SIZE + 1 :
-				QUOTA_UNIT_SIZE * UINT32_MAX;
+/** Watermark callback, see quota_set_watermarks(). */
+typedef void
+(*quota_watermark_f)(struct quota *quota, enum quota_watermark watermark,
+		     void *arg);
+
+static const size_t QUOTA_MAX = (uint64_t)SIZE_MAX > (uint64_t)INT64_MAX ?
+				(size_t)INT64_MAX & ~(QUOTA_UNIT_SIZE - 1) :
+				SIZE_MAX & ~(QUOTA_UNIT_SIZE - 1);
 
 /** A basic limit on memory usage */
 struct quota {
 	/**
-	 * High order dword is the total available memory
-	 * and the low order dword is the  currently used amount.
-	 * Both values are represented in units of size
-	 * QUOTA_UNIT_SIZE.
+	 * Memory which may still be used, in bytes. This is the
+	 * only word quota_use() and quota_release() touch, so
+	 * they stay lock-free. It never exceeds total minus the
+	 * currently used amount: quota_set() takes the difference
+	 * from it before lowering the limit and adds it after
+	 * raising one.
+	 */
+	uint64_t available;
+	/** The memory limit, in bytes. Changed by quota_set() only. */
+	uint64_t total;
+	/**
+	 * A quota this one is a part of, NULL for a top level
+	 * quota. Memory used from a quota is used from all its
+	 * ancestors as well, so that several subsystems can
+	 * have their own limits within a common one.
+	 */
+	struct quota *parent;
+	/** The number of threads waiting for the quota. */
+	uint32_t waiters;
+	/**
+	 * Futex word the waiters sleep on. Bumped when memory is
+	 * released or the limit is raised while there are waiters.
 	 */
-	uint64_t value;
+	uint32_t wait_seq;
+	/**
+	 * Per-CPU caches of memory used from the quota, NULL if
+	 * the quota is not sharded, see quota_shards_create().
+	 */
+	struct quota_shard *shards;
+	/** The number of shards. */
+	uint32_t shard_count;
+	/** The amount of memory a shard takes from the quota at once. */
+	uint64_t shard_slack;
+	/** Called when the usage crosses a watermark, may be NULL. */
+	quota_watermark_f watermark_cb;
+	/** Argument of watermark_cb. */
+	void *watermark_arg;
+	/** Soft limits on the usage, in bytes. */
+	uint64_t low_watermark;
+	uint64_t high_watermark;
+	/**
+	 * Set when the usage has reached the high watermark and
+	 * hasn't gone down to the low one since.
+	 */
+	uint32_t is_above_watermark;
 };
 
+/**
+ * A per-CPU cache of a sharded quota. Uses and releases are
+ * served from it without touching the shared quota words while
+ * it has enough memory and doesn't have too much.
+ */
+struct quota_shard {
+	/** Memory taken from the quota and not used yet, in bytes. */
+	uint64_t available;
+	/** Shards of different CPUs must not share a cache line. */
+	char pad[64 - sizeof(uint64_t)];
+};
+
+/** Round @a size up to a multiple of QUOTA_UNIT_SIZE. */
+static inline uint64_t
+quota_align(size_t size)
+{
+	return ((uint64_t)size + (QUOTA_UNIT_SIZE - 1)) &
+		~(QUOTA_UNIT_SIZE - 1);
+}
+
 /**
  * Initialize quota with a given memory limit
  */
 static inline void
 quota_init(struct quota *quota, size_t total)
 {
-	uint64_t new_total = (total + (QUOTA_UNIT_SIZE - 1)) /
-				QUOTA_UNIT_SIZE;
-	quota->value = new_total << 32;
+	assert(total <= QUOTA_MAX);
+	quota->total = quota_align(total);
+	quota->available = quota->total;
+	quota->parent = NULL;
+	quota->waiters = 0;
+	quota->wait_seq = 0;
+	quota->shards = NULL;
+	quota->shard_count = 0;
+	quota->shard_slack = 0;
+	quota->watermark_cb = NULL;
+	quota->watermark_arg = NULL;
+	quota->low_watermark = 0;
+	quota->high_watermark = 0;
+	quota->is_above_watermark = 0;
+}
+
+/**
+ * Initialize a quota with a given memory limit as a part of
+ * @a parent quota. The limit of the child may exceed the limit
+ * of the parent, the child is limited by both.
+ */
+static inline void
+quota_init_child(struct quota *quota, struct quota *parent, size_t total)
+{
+	quota_init(quota, total);
+	quota->parent = parent;
 }
 
 /**
@@ -76,24 +186,343 @@ quota_init(struct quota *quota, size_t total)
 static inline size_t
 quota_total(const struct quota *quota)
 {
-	return (quota->value >> 32) * QUOTA_UNIT_SIZE;
+	return pm_atomic_load(&quota->total);
+}
+
+static inline void
+quota_get_total_and_used(struct quota *quota, size_t *total, size_t *used)
+{
+	/*
+	 * The two words can't be read at once. Retry if the
+	 * limit changes in between, so that the usage is never
+	 * computed against a wrong limit. It may still be
+	 * overestimated while quota_set() is in progress.
+	 */
+	uint64_t t, a;
+	do {
+		t = pm_atomic_load(&quota->total);
+		a = pm_atomic_load(&quota->available);
+	} while (t != pm_atomic_load(&quota->total));
+	*total = t;
+	*used = a < t ? t - a : 0;
 }
 
 /**
- * Get current quota usage
+ * Get current quota usage. For a sharded quota it includes the
+ * memory cached in the shards.
  */
 static inline size_t
 quota_used(const struct quota *quota)
 {
-	return (quota->value & UINT32_MAX) * QUOTA_UNIT_SIZE;
+	size_t total, used;
+	quota_get_total_and_used((struct quota *)quota, &total, &used);
+	return used;
 }
 
+/** Futex operations, see futex(2). */
+enum {
+	QUOTA_FUTEX_WAIT = 0,
+	QUOTA_FUTEX_WAKE = 1,
+};
+
+/** Wake up threads waiting for the quota, if any. */
 static inline void
-quota_get_total_and_used(struct quota *quota, size_t *total, size_t *used)
+quota_wakeup(struct quota *quota)
+{
+	if (pm_atomic_load(&quota->waiters) == 0)
+		return;
+	pm_atomic_fetch_add(&quota->wait_seq, 1);
+#if defined(__linux__)
+	syscall(SYS_futex, &quota->wait_seq, QUOTA_FUTEX_WAKE, INT_MAX,
+		NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Wait until quota_wakeup() is called for the quota after the
+ * wait_seq value @a seq was read, or @a timeout seconds pass.
+ */
+static inline void
+quota_wait(struct quota *quota, uint32_t seq, double timeout)
+{
+	struct timespec ts;
+	/* Waiting for too long is the same as forever. */
+	if (timeout > (double)INT_MAX)
+		timeout = INT_MAX;
+	ts.tv_sec = (time_t)timeout;
+	ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+#if defined(__linux__)
+	syscall(SYS_futex, &quota->wait_seq, QUOTA_FUTEX_WAIT, seq,
+		&ts, NULL, 0);
+#else
+	/* Poll with a small period where futexes are not available. */
+	(void)quota;
+	(void)seq;
+	struct timespec period = { 0, 1000000 };
+	nanosleep(ts.tv_sec > 0 || ts.tv_nsec > period.tv_nsec ?
+		  &period : &ts, NULL);
+#endif
+}
+
+static inline double
+quota_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Set soft limits on the quota usage. @a cb is called with
+ * QUOTA_WATERMARK_HIGH when the usage reaches @a high and then
+ * with QUOTA_WATERMARK_LOW when it goes down to @a low, so that
+ * memory can be reclaimed before quota_use() starts failing.
+ * The callback is called once per crossing, from the thread
+ * which has crossed the watermark, and must not use the quota.
+ * @a cb may be NULL to remove the watermarks.
+ * Must not be called concurrently with other quota operations.
+ */
+static inline void
+quota_set_watermarks(struct quota *quota, size_t low, size_t high,
+		     quota_watermark_f cb, void *arg)
+{
+	assert(low <= high);
+	quota->low_watermark = low;
+	quota->high_watermark = high;
+	quota->watermark_arg = arg;
+	quota->watermark_cb = cb;
+	quota->is_above_watermark = 0;
+}
+
+/**
+ * Fire the watermark callback if the usage corresponding to
+ * @a available crossed a watermark.
+ */
+static inline void
+quota_check_watermarks(struct quota *quota, uint64_t available)
+{
+	uint64_t total = pm_atomic_load(&quota->total);
+	uint64_t used = available < total ? total - available : 0;
+	uint32_t is_above = pm_atomic_load(&quota->is_above_watermark);
+	if (!is_above && used >= quota->high_watermark) {
+		if (pm_atomic_compare_exchange_strong(
+				&quota->is_above_watermark, &is_above, 1))
+			quota->watermark_cb(quota, QUOTA_WATERMARK_HIGH,
+					    quota->watermark_arg);
+	} else if (is_above && used <= quota->low_watermark) {
+		if (pm_atomic_compare_exchange_strong(
+				&quota->is_above_watermark, &is_above, 0))
+			quota->watermark_cb(quota, QUOTA_WATERMARK_LOW,
+					    quota->watermark_arg);
+	}
+}
+
+/**
+ * Take @a size bytes, which must be aligned, from a single
+ * quota, not looking at its parent.
+ * @retval 0 on success
+ * @retval -1 if the quota limit is reached
+ */
+static inline int
+quota_use_aligned(struct quota *quota, uint64_t size)
+{
+	uint64_t available = pm_atomic_load(&quota->available);
+	do {
+		if (available < size)
+			return -1;
+	} while (!pm_atomic_compare_exchange_weak(&quota->available,
+						  &available,
+						  available - size));
+	if (quota->watermark_cb != NULL)
+		quota_check_watermarks(quota, available - size);
+	return 0;
+}
+
+/**
+ * Return @a size bytes, which must be aligned, to a single
+ * quota, not looking at its parent.
+ */
+static inline void
+quota_release_aligned(struct quota *quota, uint64_t size)
+{
+	uint64_t available = pm_atomic_fetch_add(&quota->available, size);
+	if (quota->watermark_cb != NULL)
+		quota_check_watermarks(quota, available + size);
+}
+
+/**
+ * Take aligned @a size from the quota and all its ancestors,
+ * child first, rolling back on failure.
+ * @retval NULL on success
+ * @retval the quota which limit is reached
+ */
+static inline struct quota *
+quota_use_chain(struct quota *quota, uint64_t size)
 {
-	uint64_t value = quota->value;
-	*total = (value >> 32) * QUOTA_UNIT_SIZE;
-	*used = (value & UINT32_MAX) * QUOTA_UNIT_SIZE;
+	struct quota *q;
+	for (q = quota; q != NULL; q = q->parent) {
+		if (quota_use_aligned(q, size) == 0)
+			continue;
+		/* Roll back. */
+		struct quota *r;
+		for (r = quota; r != q; r = r->parent)
+			quota_release_aligned(r, size);
+		return q;
+	}
+	return NULL;
+}
+
+/**
+ * Return aligned @a size to the quota and all its ancestors
+ * and wake up the threads waiting for memory.
+ */
+static inline void
+quota_release_chain(struct quota *quota, uint64_t size)
+{
+	struct quota *q;
+	for (q = quota; q != NULL; q = q->parent) {
+		quota_release_aligned(q, size);
+		quota_wakeup(q);
+	}
+}
+
+/**
+ * Make the quota sharded. Each CPU then takes memory from the
+ * quota by @a slack bytes at once and serves uses and releases
+ * from its own shard, so that the quota shared by many threads
+ * isn't a contention point. The limit is still respected: the
+ * memory cached in the shards is accounted in the quota as
+ * used, there is at most 2 * @a slack bytes of it per shard and
+ * it is given back to the quota whenever the quota runs out.
+ *
+ * @param shards array of @a count shards, @a count is
+ *        normally the number of CPUs.
+ * Must not be called concurrently with other quota operations.
+ */
+static inline void
+quota_shards_create(struct quota *quota, struct quota_shard *shards,
+		    uint32_t count, size_t slack)
+{
+	assert(count > 0);
+	uint32_t i;
+	for (i = 0; i < count; i++)
+		shards[i].available = 0;
+	quota->shard_count = count;
+	quota->shard_slack = quota_align(slack);
+	quota->shards = shards;
+}
+
+/**
+ * Give the memory cached in the shards back to the quota.
+ * After that quota_used() is exact until the next use.
+ */
+static inline void
+quota_shards_flush(struct quota *quota)
+{
+	uint32_t i;
+	for (i = 0; i < quota->shard_count; i++) {
+		uint64_t size = pm_atomic_exchange(
+			&quota->shards[i].available, 0);
+		if (size != 0)
+			quota_release_chain(quota, size);
+	}
+}
+
+/**
+ * Flush the shards and make the quota not sharded again.
+ * Must not be called concurrently with other quota operations.
+ */
+static inline void
+quota_shards_destroy(struct quota *quota)
+{
+	quota_shards_flush(quota);
+	quota->shards = NULL;
+	quota->shard_count = 0;
+	quota->shard_slack = 0;
+}
+
+/** The shard of the CPU the caller runs on. */
+static inline struct quota_shard *
+quota_shard_current(struct quota *quota)
+{
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	int cpu = sched_getcpu();
+	uintptr_t idx = cpu >= 0 ? (uintptr_t)cpu : 0;
+#else
+	/* Threads have different stacks, use it as a thread id. */
+	uintptr_t idx = (uintptr_t)&quota >> 16;
+#endif
+	return &quota->shards[idx % quota->shard_count];
+}
+
+/**
+ * Take aligned @a size from a sharded quota. The current shard
+ * is used first, then it's refilled from the quota. If the quota
+ * is exhausted, the memory cached by other shards is reclaimed.
+ * @retval NULL on success
+ * @retval the quota which limit is reached
+ */
+static inline struct quota *
+quota_shards_use(struct quota *quota, uint64_t size)
+{
+	struct quota_shard *shard = quota_shard_current(quota);
+	uint64_t available = pm_atomic_load(&shard->available);
+	while (available >= size) {
+		if (pm_atomic_compare_exchange_weak(&shard->available,
+						    &available,
+						    available - size))
+			return NULL;
+	}
+	if (quota_use_chain(quota, size + quota->shard_slack) == NULL) {
+		pm_atomic_fetch_add(&shard->available, quota->shard_slack);
+		return NULL;
+	}
+	struct quota *failed = quota_use_chain(quota, size);
+	if (failed == NULL)
+		return NULL;
+	quota_shards_flush(quota);
+	return quota_use_chain(quota, size);
+}
+
+/** Return aligned @a size to a sharded quota. */
+static inline void
+quota_shards_release(struct quota *quota, uint64_t size)
+{
+	struct quota_shard *shard = quota_shard_current(quota);
+	uint64_t available = pm_atomic_fetch_add(&shard->available, size);
+	available += size;
+	/*
+	 * Keep no more than the slack if there is too much or
+	 * if someone waits for memory. A waiter registers
+	 * before reclaiming the shards, so either it sees the
+	 * memory added above or it is seen here.
+	 */
+	uint64_t keep = pm_atomic_load(&quota->waiters) != 0 ? 0 :
+			quota->shard_slack;
+	if (available <= keep ||
+	    (keep != 0 && available <= 2 * quota->shard_slack))
+		return;
+	while (available > keep) {
+		if (pm_atomic_compare_exchange_weak(&shard->available,
+						    &available, keep)) {
+			quota_release_chain(quota, available - keep);
+			return;
+		}
+	}
+}
+
+/**
+ * Take aligned @a size from the quota, via a shard if the
+ * quota is sharded, and from all its ancestors.
+ * @retval NULL on success
+ * @retval the quota which limit is reached
+ */
+static inline struct quota *
+quota_take(struct quota *quota, uint64_t size)
+{
+	if (quota->shards != NULL)
+		return quota_shards_use(quota, size);
+	return quota_use_chain(quota, size);
 }
 
 /**
@@ -107,23 +536,46 @@ quota_set(struct quota *quota, size_t new_total)
 {
 	assert(new_total <= QUOTA_MAX);
 	/* Align the new total */
-	uint32_t new_total_in_units = (new_total + (QUOTA_UNIT_SIZE - 1)) /
-					QUOTA_UNIT_SIZE;
+	uint64_t aligned_total = quota_align(new_total);
 	while (1) {
-		uint64_t value = quota->value;
-		uint32_t used_in_units = value & UINT32_MAX;
-		if (new_total_in_units < used_in_units)
-			return  -1;
-		uint64_t new_value =
-			((uint64_t) new_total_in_units << 32) | used_in_units;
-		if (pm_atomic_compare_exchange_weak(&quota->value, &value, new_value))
+		uint64_t total = pm_atomic_load(&quota->total);
+		if (aligned_total >= total) {
+			if (!pm_atomic_compare_exchange_strong(&quota->total,
+							       &total,
+							       aligned_total))
+				continue;
+			pm_atomic_fetch_add(&quota->available,
+					    aligned_total - total);
+			break;
+		}
+		/* Take the difference first, so it can't be used. */
+		uint64_t delta = total - aligned_total;
+		uint64_t available = pm_atomic_load(&quota->available);
+		if (available < delta && quota->shards != NULL) {
+			/* Memory may be cached in the shards. */
+			quota_shards_flush(quota);
+			available = pm_atomic_load(&quota->available);
+		}
+		do {
+			if (available < delta)
+				return -1;
+		} while (!pm_atomic_compare_exchange_weak(&quota->available,
+							  &available,
+							  available - delta));
+		if (pm_atomic_compare_exchange_strong(&quota->total, &total,
+						      aligned_total))
 			break;
+		/* The limit was changed concurrently, retry. */
+		pm_atomic_fetch_add(&quota->available, delta);
 	}
-	return new_total_in_units * QUOTA_UNIT_SIZE;
+	quota_wakeup(quota);
+	return aligned_total;
 }
 
 /**
- * Use up a quota
+ * Use up a quota. The memory is taken from the quota and all
+ * its ancestors, child first. If any of them is exhausted, the
+ * memory already taken is given back.
  * @retval > 0 aligned value on success
  * @retval -1  on error - if quota limit reached
  */
@@ -132,52 +584,78 @@ quota_use(struct quota *quota, size_t size)
 {
 	if (size > QUOTA_MAX)
 		return -1;
-	uint32_t size_in_units = (size + (QUOTA_UNIT_SIZE - 1))
-				  / QUOTA_UNIT_SIZE;
-	assert(size_in_units);
-	while (1) {
-		uint64_t value = quota->value;
-		uint32_t total_in_units = value >> 32;
-		uint32_t used_in_units = value & UINT32_MAX;
-
-		uint32_t new_used_in_units = used_in_units + size_in_units;
-		assert(new_used_in_units > used_in_units);
+	uint64_t aligned_size = quota_align(size);
+	assert(aligned_size);
+	if (quota_take(quota, aligned_size) != NULL)
+		return -1;
+	return aligned_size;
+}
 
-		if (new_used_in_units > total_in_units)
+/**
+ * Use up a quota, waiting for up to @a timeout seconds until
+ * enough memory is released if the quota limit is reached.
+ * @retval > 0 aligned value on success
+ * @retval -1  on timeout, errno is set to ETIMEDOUT, or if
+ *             @a size exceeds QUOTA_MAX, errno is set to EINVAL
+ */
+static inline ssize_t
+quota_use_timed(struct quota *quota, size_t size, double timeout)
+{
+	if (size > QUOTA_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t aligned_size = quota_align(size);
+	assert(aligned_size);
+	double deadline = quota_clock() + timeout;
+	struct quota *q;
+	while ((q = quota_take(quota, aligned_size)) != NULL) {
+		double now = quota_clock();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
 			return -1;
-
-		uint64_t new_value =
-			((uint64_t) total_in_units << 32) | new_used_in_units;
-
-		if (pm_atomic_compare_exchange_weak(&quota->value, &value, new_value))
+		}
+		/*
+		 * Register as a waiter and try again: memory
+		 * released after that bumps wait_seq, so the
+		 * wakeup can't be missed.
+		 */
+		pm_atomic_fetch_add(&q->waiters, 1);
+		uint32_t seq = pm_atomic_load(&q->wait_seq);
+		struct quota *failed = quota_take(quota, aligned_size);
+		if (failed == q)
+			quota_wait(q, seq, deadline - now);
+		pm_atomic_fetch_sub(&q->waiters, 1);
+		if (failed == NULL)
 			break;
 	}
-	return size_in_units * QUOTA_UNIT_SIZE;
+	return aligned_size;
 }
 
-/** Release used memory */
+/**
+ * Use up a quota, waiting as long as needed until enough memory
+ * is released. Never returns if @a size exceeds the limit.
+ * @retval > 0 aligned value
+ * @retval -1  if @a size exceeds QUOTA_MAX, errno is set to EINVAL
+ */
 static inline ssize_t
-quota_release(struct quota *quota, size_t size)
+quota_use_wait(struct quota *quota, size_t size)
 {
-	assert(size < QUOTA_MAX);
-	uint32_t size_in_units = (size + (QUOTA_UNIT_SIZE - 1))
-				  / QUOTA_UNIT_SIZE;
-	assert(size_in_units);
-	while (1) {
-		uint64_t value = quota->value;
-		uint32_t total_in_units = value >> 32;
-		uint32_t used_in_units = value & UINT32_MAX;
-
-		assert(size_in_units <= used_in_units);
-		uint32_t new_used_in_units = used_in_units - size_in_units;
-
-		uint64_t new_value =
-			((uint64_t) total_in_units << 32) | new_used_in_units;
+	return quota_use_timed(quota, size, INFINITY);
+}
 
-		if (pm_atomic_compare_exchange_weak(&quota->value, &value, new_value))
-			break;
-	}
-	return size_in_units * QUOTA_UNIT_SIZE;
+/** Release used memory to the quota and all its ancestors. */
+static inline ssize_t
+quota_release(struct quota *quota, size_t size)
+{
+	assert(size <= QUOTA_MAX);
+	uint64_t aligned_size = quota_align(size);
+	assert(aligned_size);
+	if (quota->shards != NULL)
+		quota_shards_release(quota, aligned_size);
+	else
+		quota_release_chain(quota, aligned_size);
+	return aligned_size;
 }
 
 #if defined(__cplusplus)
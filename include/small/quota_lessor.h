@@ -34,8 +34,8 @@
 /**
  * Quota lessor is a convenience wrapper around thread-safe `struct quota`
  * to allocate small chunks of memory from the single thread. Original quota
- * has 1Kb precision and uses atomics, which are too slow for frequent calls
- * from different threads.
+ * has 64 byte precision and uses atomics, which are too slow for frequent
+ * calls from different threads.
  *
  * The quota lessor allocates huge (1Mb+) chunks of memory from
  * the source quota and then leases small chunks to the end users.
@@ -43,17 +43,32 @@
  * does not release small amounts, but accumulates freed memory until
  * it reaches at least 1Mb an then releases it.
  *
+ * The chunk size adapts to the lease rate: a busy lessor takes
+ * bigger chunks to go to the source quota less often, an idle
+ * one takes and keeps less memory. Until the rate is measured
+ * the chunk size is QUOTA_USE_MIN.
+ *
  * This decreases usage of atomic locks and improves quota
- * precision from 1024 bytes to 1 byte. This class, however, is
+ * precision from 64 bytes to 1 byte. This class, however, is
  * not thread-safe, so there must be a lessor in each thread.
  */
 struct quota_lessor {
-	/** Original thread-safe, 1Kb precision quota. */
+	/** Original thread-safe, 64 byte precision quota. */
 	struct quota *source;
 	/** The number of bytes taken from @a source. */
 	size_t used;
 	/** The number of bytes leased. */
 	size_t leased;
+	/** The number of bytes taken from @a source at once. */
+	size_t use_min;
+	/** The number of bytes leased in the current rate window. */
+	size_t window_leased;
+	/** The time the current rate window started at. */
+	double window_start;
+	/** Lease rate, bytes per second, averaged over windows. */
+	double lease_rate;
+	/** The number of quota_end_lease() calls, to check the time rarely. */
+	unsigned end_count;
 };
 
 /**
@@ -76,8 +91,33 @@ quota_available(const struct quota_lessor *lessor)
 	return lessor->used - lessor->leased;
 }
 
-/** Min byte count to alloc from original quota. */
-#define QUOTA_USE_MIN (QUOTA_UNIT_SIZE * 1024)
+/** Min byte count to alloc from original quota by default. */
+#define QUOTA_USE_MIN (1024 * 1024ULL)
+
+enum {
+	/** Bounds of the adaptive byte count to alloc at once. */
+	QUOTA_LESSOR_USE_MIN_LOW = 64 * 1024,
+	QUOTA_LESSOR_USE_MIN_HIGH = 64 * 1024 * 1024,
+	/** quota_end_lease() calls between lease rate updates. */
+	QUOTA_LESSOR_END_PERIOD = 64,
+};
+
+/** Duration of a lease rate window, seconds. */
+#define QUOTA_LESSOR_WINDOW 0.1
+/** Time over which the lease rate is averaged, seconds. */
+#define QUOTA_LESSOR_RATE_PERIOD 1.0
+
+/**
+ * Return the lease rate, in bytes per second, averaged over
+ * about QUOTA_LESSOR_RATE_PERIOD. Zero until the first rate
+ * window is over.
+ * @param lessor quota_lessor
+ */
+static inline double
+quota_lease_rate(const struct quota_lessor *lessor)
+{
+	return lessor->lease_rate;
+}
 
 /**
  * Create a new quota lessor from @a source.
@@ -90,9 +130,39 @@ quota_lessor_create(struct quota_lessor *lessor, struct quota *source)
 	lessor->source = source;
 	lessor->used = 0;
 	lessor->leased = 0;
+	lessor->use_min = QUOTA_USE_MIN;
+	lessor->window_leased = 0;
+	lessor->window_start = quota_clock();
+	lessor->lease_rate = 0;
+	lessor->end_count = 0;
 	assert(quota_total(source) >= QUOTA_USE_MIN);
 }
 
+/**
+ * Update the lease rate if the current rate window is over and
+ * size the chunks taken from the source to last for a window.
+ */
+static inline void
+quota_lessor_update_rate(struct quota_lessor *lessor)
+{
+	double now = quota_clock();
+	double elapsed = now - lessor->window_start;
+	if (elapsed < QUOTA_LESSOR_WINDOW)
+		return;
+	double rate = lessor->window_leased / elapsed;
+	/* The longer the window, the more it weighs. */
+	double weight = elapsed / (elapsed + QUOTA_LESSOR_RATE_PERIOD);
+	lessor->lease_rate += (rate - lessor->lease_rate) * weight;
+	double use_min = lessor->lease_rate * QUOTA_LESSOR_WINDOW;
+	if (use_min < QUOTA_LESSOR_USE_MIN_LOW)
+		use_min = QUOTA_LESSOR_USE_MIN_LOW;
+	if (use_min > QUOTA_LESSOR_USE_MIN_HIGH)
+		use_min = QUOTA_LESSOR_USE_MIN_HIGH;
+	lessor->use_min = quota_align((size_t)use_min);
+	lessor->window_leased = 0;
+	lessor->window_start = now;
+}
+
 /**
  * Destroy the quota lessor
  * @param lessor quota_lessor
@@ -122,11 +192,13 @@ quota_lease(struct quota_lessor *lessor, ssize_t size)
 	/* Fast way, there is enough unused quota. */
 	if (lessor->leased + size <= lessor->used) {
 		lessor->leased += size;
+		lessor->window_leased += size;
 		return size;
 	}
 	/* Need to use the original quota. */
+	quota_lessor_update_rate(lessor);
 	size_t required = size + lessor->leased - lessor->used;
-	size_t use = required > QUOTA_USE_MIN ? required : QUOTA_USE_MIN;
+	size_t use = required > lessor->use_min ? required : lessor->use_min;
 
 	for (; use >= required; use = use/2) {
 
@@ -134,6 +206,7 @@ quota_lease(struct quota_lessor *lessor, ssize_t size)
 		if (used >= 0) {
 			lessor->used += used;
 			lessor->leased += size;
+			lessor->window_leased += size;
 			return size;
 		}
 	}
@@ -155,9 +228,12 @@ quota_end_lease(struct quota_lessor *lessor, size_t size)
 	 * Release the original quota when enough bytes
 	 * accumulated to avoid frequent quota_release() calls.
 	 */
-	if (available >= 2 * QUOTA_USE_MIN) {
+	if (available >= 2 * QUOTA_LESSOR_USE_MIN_LOW &&
+	    ++lessor->end_count % QUOTA_LESSOR_END_PERIOD == 0)
+		quota_lessor_update_rate(lessor);
+	if (available >= 2 * lessor->use_min) {
 		/* Do not release too much to avoid oscillation. */
-		size_t release = available - QUOTA_USE_MIN - QUOTA_UNIT_SIZE;
+		size_t release = available - lessor->use_min - QUOTA_UNIT_SIZE;
 		lessor->used -= quota_release(lessor->source, release);
 	}
 	return size;
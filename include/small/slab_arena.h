@@ -31,8 +31,10 @@
  * SUCH DAMAGE.
  */
 #include "lf_lifo.h"
+#include "rlist.h"
 #include <sys/mman.h>
 #include <limits.h>
+#include <stdbool.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -41,6 +43,15 @@ extern "C" {
 enum {
 	/* Smallest possible slab size. */
 	SLAB_MIN_SIZE = ((size_t)USHRT_MAX) + 1,
+	/** Max number of NUMA nodes an arena can be bound to. */
+	SLAB_ARENA_NODE_MAX = 1024,
+	/** The number of slabs in a magazine of slab_thread_cache. */
+	SLAB_MAGAZINE_SIZE = 16,
+	/**
+	 * The max number of magazines in the depot of an arena,
+	 * the magazines beyond it go to the arena cache.
+	 */
+	SLAB_DEPOT_MAX = 16,
 	/** The largest allowed amount of memory of a single arena. */
 	SMALL_UNLIMITED = SIZE_MAX/2 + 1
 };
@@ -66,7 +77,90 @@ enum {
 	SLAB_ARENA_SHARED	= SLAB_ARENA_FLAG(1 << 1),
 
 	/* madvise() flags */
-	SLAB_ARENA_DONTDUMP	= SLAB_ARENA_FLAG(1 << 2)
+	SLAB_ARENA_DONTDUMP	= SLAB_ARENA_FLAG(1 << 2),
+
+	/*
+	 * Back slabs with explicit huge pages (MAP_HUGETLB),
+	 * falling back to regular pages if the system has no
+	 * huge pages reserved. slab_arena_create() fails with
+	 * EINVAL if the slab size is not a multiple of the huge
+	 * page size.
+	 */
+	SLAB_ARENA_HUGEPAGE	= SLAB_ARENA_FLAG(1 << 3),
+	/* Advise transparent huge pages (MADV_HUGEPAGE). */
+	SLAB_ARENA_THP		= SLAB_ARENA_FLAG(1 << 4),
+	/*
+	 * Reserve address space for the whole quota on creation
+	 * and commit slabs in it on demand with mprotect(), so
+	 * that new slabs are contiguous and are not mapped one
+	 * by one. Ignored with explicit huge pages.
+	 */
+	SLAB_ARENA_RESERVE	= SLAB_ARENA_FLAG(1 << 5),
+	/*
+	 * Fault in the preallocated arena on creation using
+	 * a pool of threads, so that slab_map() does not pay
+	 * for page faults later.
+	 */
+	SLAB_ARENA_PREFAULT	= SLAB_ARENA_FLAG(1 << 6),
+	/*
+	 * Exclude memory of free slabs, except the first page
+	 * of each slab, from child processes (MADV_DONTFORK),
+	 * so that fork() doesn't copy page tables of memory
+	 * which is not in use.
+	 *
+	 * A child must not take slabs from the arena: the
+	 * excluded part of a free slab is not mapped in the
+	 * child at all, MADV_DOFORK can't bring it back, and
+	 * the first access to it faults.
+	 *
+	 * Each excluded slab takes a separate VMA, so a large
+	 * arena may hit vm.max_map_count. madvise() fails with
+	 * ENOMEM then and the slab is simply not excluded, see
+	 * slab_arena_stats::fork_advise_failures.
+	 */
+	SLAB_ARENA_DONTFORK	= SLAB_ARENA_FLAG(1 << 7)
+};
+
+struct slab_arena_purger;
+struct slab_arena_header;
+
+/**
+ * Arena statistics. All counters are updated with relaxed
+ * atomics on the respective slab_map()/slab_unmap() paths.
+ */
+struct slab_arena_stats {
+	/** The number of slabs reused from the cache. */
+	size_t cache_hits;
+	/** The number of slabs taken from the preallocated arena. */
+	size_t prealloc_hits;
+	/** The number of mmap() calls, including failed ones. */
+	size_t mmap_calls;
+	/**
+	 * The number of mmap() calls which returned a misaligned
+	 * address, so the area had to be mapped again.
+	 */
+	size_t misaligned_retries;
+	/** The number of slab requests refused by the quota. */
+	size_t quota_failures;
+	/** The number of bytes in the cache. */
+	size_t cached;
+	/**
+	 * The number of bytes returned to the operating system
+	 * by slab_arena_trim() and slab_arena_shrink().
+	 */
+	size_t purged;
+	/**
+	 * The number of slabs created by the arena which are
+	 * backed by huge pages: either mapped with MAP_HUGETLB
+	 * or successfully advised with MADV_HUGEPAGE.
+	 */
+	size_t hugepage_slabs;
+	/**
+	 * The number of MADV_DONTFORK or MADV_DOFORK calls which
+	 * failed, e.g. with SLAB_ARENA_DONTFORK splitting the
+	 * arena in more VMAs than vm.max_map_count allows.
+	 */
+	size_t fork_advise_failures;
 };
 
 /**
@@ -74,7 +168,10 @@ enum {
  * MT-safe.
  * Uses a lock-free LIFO to maintain a cache of used slabs.
  * Uses a lock-free quota to limit allocating memory.
- * Never returns memory to the operating system.
+ * Never unmaps slabs, but can return memory of cached slabs
+ * which stay idle for long to the operating system, see
+ * slab_arena_trim(), or give it back to the quota, see
+ * slab_arena_shrink().
  */
 struct slab_arena {
 	/**
@@ -84,18 +181,30 @@ struct slab_arena {
 	 * used to recycle them.
 	 */
 	struct lf_lifo cache;
-	/** A preallocated arena of size = prealloc. */
+	/** A preallocated arena of size = reserved. */
 	void *arena;
 	/**
 	 * How much memory is preallocated during initialization
 	 * of slab_arena.
 	 */
 	size_t prealloc;
+	/**
+	 * Size of address space reserved for the arena. Equals
+	 * prealloc unless SLAB_ARENA_RESERVE is set, in which
+	 * case the memory beyond prealloc is committed slab by
+	 * slab as it is used.
+	 */
+	size_t reserved;
 	/**
 	 * How much memory in the arena has
 	 * already been initialized for slabs.
 	 */
 	size_t used;
+	/**
+	 * Reserved slabs which failed to be committed. They are
+	 * accounted in used, but never handed out.
+	 */
+	size_t lost;
 	/**
 	 * An external quota to which we must adhere.
 	 * A quota exists to set a common limit on two arenas.
@@ -121,6 +230,115 @@ struct slab_arena {
 	 * SLAB_ARENA_ flags for mmap() and madvise() calls.
 	 */
 	int flags;
+	/**
+	 * Size of a huge page used for SLAB_ARENA_HUGEPAGE
+	 * mappings, 0 if explicit huge pages are not used.
+	 */
+	size_t hugepage_size;
+	/** True if the preallocated arena is backed by huge pages. */
+	bool prealloc_is_huge;
+	/**
+	 * NUMA node the arena memory is bound to,
+	 * -1 if the arena is not bound.
+	 */
+	int node;
+	/**
+	 * A cached slab which stays unused for longer than
+	 * this number of seconds is purged by slab_arena_trim().
+	 */
+	double purge_delay;
+	/**
+	 * The amount of most recently cached slabs which are
+	 * never purged, to not pay for page faults on reuse.
+	 */
+	size_t purge_watermark;
+	/** Background purge thread, NULL if not started. */
+	struct slab_arena_purger *purger;
+	/** Arena statistics, see slab_arena_stats(). */
+	struct slab_arena_stats stats;
+	/**
+	 * Header of a file backed arena, see
+	 * slab_arena_create_file(). NULL for anonymous memory.
+	 */
+	struct slab_arena_header *header;
+	/**
+	 * Cached slabs moved aside one by one by slab_arena_trim()
+	 * and slab_arena_shrink() while they walk the cache.
+	 * slab_map() takes slabs from here too, so they stay
+	 * available during the walk.
+	 */
+	struct lf_lifo scan;
+	/**
+	 * A lock free list of full magazines of free slabs,
+	 * exchanged whole with slab_thread_cache objects.
+	 * A magazine is stored in its first slab.
+	 */
+	struct lf_lifo depot;
+	/** The number of magazines in the depot. */
+	size_t depot_size;
+	/**
+	 * Purged cached slabs which memory is no longer accounted
+	 * in the quota, see slab_arena_shrink(). They are reused
+	 * when a new slab is mapped.
+	 */
+	struct lf_lifo released;
+	/** Registered slab_arena_shrinker objects. */
+	struct rlist shrinkers;
+};
+
+/**
+ * A holder of free slabs of an arena, e.g. a slab cache, which
+ * can give them back to the arena on slab_arena_shrink().
+ */
+struct slab_arena_shrinker {
+	/** Link in slab_arena::shrinkers. */
+	struct rlist in_arena;
+	/**
+	 * Return free slabs to the arena. Called from the thread
+	 * which shrinks the arena, so a holder used by another
+	 * thread may only request its owner thread to return the
+	 * slabs later. Returns the number of bytes returned now.
+	 */
+	size_t (*shrink)(struct slab_arena_shrinker *shrinker);
+};
+
+/** A fixed-size stack of free slabs. */
+struct slab_magazine {
+	/** The number of slabs in the magazine. */
+	uint32_t count;
+	void *slabs[SLAB_MAGAZINE_SIZE];
+};
+
+/**
+ * A per-thread cache of free slabs in front of an arena, so that
+ * most slab_map()/slab_unmap() calls don't touch the arena.
+ *
+ * The cache keeps two magazines: slabs are taken from and put to
+ * the loaded one, the previous one is swapped in when the loaded
+ * one runs empty or full. When both magazines are empty, a full
+ * magazine is taken from the arena depot, or a slab is mapped
+ * from the arena if the depot is empty. When both are full, the
+ * previous magazine is given to the depot. This way a thread
+ * which oscillates around a magazine boundary doesn't thrash the
+ * depot. See J. Bonwick, J. Adams, "Magazines and Vmem", 2001.
+ *
+ * The depot keeps up to SLAB_DEPOT_MAX magazines, the rest go to
+ * the arena cache. slab_map() and slab_map_batch() take slabs
+ * from the depot when the cache is empty, so slabs in the depot
+ * are never lost for the arena.
+ *
+ * slab_cache doesn't use a thread cache: it is a per-thread cache
+ * of arena slabs itself, see slab_cache_set_retention().
+ *
+ * Not thread-safe, there must be a cache in each thread.
+ */
+struct slab_thread_cache {
+	struct slab_arena *arena;
+	/** The magazine the slabs are taken from and put to. */
+	struct slab_magazine *loaded;
+	/** The magazine which was loaded before. */
+	struct slab_magazine *prev;
+	struct slab_magazine magazines[2];
 };
 
 /** Initialize an arena.  */
@@ -128,7 +346,39 @@ int
 slab_arena_create(struct slab_arena *arena, struct quota *quota,
 		  size_t prealloc, uint32_t slab_size, int flags);
 
-/** Destroy an arena. */
+/**
+ * Initialize an arena backed by a file, e.g. a memfd, to be able
+ * to restart a process without rebuilding the data in the arena.
+ *
+ * The whole file of @a size bytes is mapped with MAP_SHARED at
+ * the fixed address @a base, so pointers stored in the arena stay
+ * valid across restarts. The first slab of the file keeps the
+ * arena header, the rest is used for slabs. The arena never maps
+ * memory beyond the file.
+ *
+ * An empty file is initialized. Otherwise the file must have been
+ * created with the same @a base, @a size and @a slab_size, and
+ * the arena is re-attached: the slabs it had handed out are still
+ * in use and accounted in @a quota, the cached slabs are reused.
+ * Use slab_arena_root() to find the data in a re-attached arena
+ * and slab_cache_reattach() to reuse slab caches stored in it.
+ *
+ * The arena state is saved in the file by slab_arena_destroy(),
+ * a file which was not detached properly can't be re-attached.
+ *
+ * @param flags SLAB_ARENA_ flags, SLAB_ARENA_SHARED is required
+ * @retval 0 on success
+ * @retval -1 on error, errno is set
+ */
+int
+slab_arena_create_file(struct slab_arena *arena, struct quota *quota,
+		       int fd, void *base, size_t size, uint32_t slab_size,
+		       int flags);
+
+/**
+ * Destroy an arena. The memory of a file backed arena is
+ * unmapped with all slabs still in use, the file keeps it.
+ */
 void
 slab_arena_destroy(struct slab_arena *arena);
 
@@ -140,6 +390,173 @@ slab_map(struct slab_arena *arena);
 void
 slab_unmap(struct slab_arena *arena, void *ptr);
 
+/**
+ * Get up to @a count slabs at once. Cached slabs are popped
+ * from the cache one by one, the rest is accounted in the quota
+ * at once and mapped with a single mmap() call.
+ * @return the number of slabs stored in @a slabs, less than
+ *         @a count if the quota is exceeded or mmap() fails.
+ */
+size_t
+slab_map_batch(struct slab_arena *arena, void **slabs, size_t count);
+
+/**
+ * Put @a count slabs into cache at once. Same as calling
+ * slab_unmap() for each slab in order, but takes a single
+ * atomic operation.
+ */
+void
+slab_unmap_batch(struct slab_arena *arena, void **slabs, size_t count);
+
+/** Initialize a per-thread slab cache of @a arena. */
+void
+slab_thread_cache_create(struct slab_thread_cache *cache,
+			 struct slab_arena *arena);
+
+/** Return all slabs of the cache to the arena. */
+void
+slab_thread_cache_destroy(struct slab_thread_cache *cache);
+
+/** Get a slab via the per-thread cache, same as slab_map(). */
+void *
+slab_thread_cache_map(struct slab_thread_cache *cache);
+
+/** Put a slab into the per-thread cache. */
+void
+slab_thread_cache_unmap(struct slab_thread_cache *cache, void *ptr);
+
+/**
+ * Exclude a free slab except its first page from child processes
+ * if the arena has SLAB_ARENA_DONTFORK flag. Used by the arena for
+ * cached slabs and by slab_cache for its free slabs.
+ */
+void
+slab_arena_dontfork(struct slab_arena *arena, void *ptr);
+
+/** Undo slab_arena_dontfork() for a slab to be used again. */
+void
+slab_arena_dofork(struct slab_arena *arena, void *ptr);
+
+/**
+ * Configure purging of cached slabs.
+ * @param arena     arena
+ * @param delay     a cached slab idle for at least @a delay
+ *                  seconds is purged
+ * @param watermark the amount of most recently cached slabs
+ *                  which are kept intact
+ */
+void
+slab_arena_set_purge(struct slab_arena *arena, double delay,
+		     size_t watermark);
+
+/**
+ * Return memory of idle cached slabs to the operating system
+ * (MADV_DONTNEED). A purged slab stays in the cache and is
+ * faulted in again on reuse. The first page of a slab, which
+ * links it in the cache, is never purged. The magazines of the
+ * depot are moved to the cache first to be purged as well.
+ * Slabs in magazines of slab_thread_cache objects are not purged.
+ *
+ * The cache is walked by moving slabs to slab_arena::scan
+ * and back one by one, so slab_map() called concurrently
+ * still reuses cached slabs.
+ *
+ * @return the number of bytes purged.
+ */
+size_t
+slab_arena_trim(struct slab_arena *arena);
+
+/**
+ * Register a shrinker to be called by slab_arena_shrink().
+ * Not thread-safe with respect to slab_arena_shrink().
+ */
+void
+slab_arena_add_shrinker(struct slab_arena *arena,
+			struct slab_arena_shrinker *shrinker);
+
+/** Unregister a shrinker, no-op if it isn't registered. */
+void
+slab_arena_remove_shrinker(struct slab_arena_shrinker *shrinker);
+
+/**
+ * Lower the arena quota limit to @a total, reclaiming idle
+ * slabs if the quota usage is above it. Free slabs are taken
+ * from the registered shrinkers and the depot, then cached
+ * slabs are reclaimed, least recently cached first: a slab is
+ * purged and its memory is given back to the quota and taken
+ * again on reuse. Slabs stay mapped, since a concurrent
+ * slab_map() may read the link of a slab it failed to pop.
+ * Slabs of a file backed arena are never reclaimed.
+ *
+ * The cache is walked by moving slabs to slab_arena::scan and
+ * back one by one, so slab_map() called concurrently still
+ * reuses cached slabs. Slabs in magazines of slab_thread_cache
+ * objects can't be reclaimed.
+ *
+ * A slab cache registered as a shrinker returns its free slabs
+ * in its owner thread on its next slab_get_with_order(),
+ * slab_get_large() or slab_cache_drain_remote() call, so the
+ * first call may fail to reclaim them. Call slab_arena_shrink()
+ * again after that.
+ *
+ * @retval 0  the limit is set
+ * @retval >0 the number of bytes which could not be
+ *            reclaimed, the limit is not changed
+ */
+size_t
+slab_arena_shrink(struct slab_arena *arena, size_t total);
+
+/**
+ * Start a background thread calling slab_arena_trim() every
+ * @a period seconds.
+ * @retval 0 on success
+ * @retval -1 on error, errno is set
+ */
+int
+slab_arena_start_purge_thread(struct slab_arena *arena, double period);
+
+/** Stop the thread started by slab_arena_start_purge_thread(). */
+void
+slab_arena_stop_purge_thread(struct slab_arena *arena);
+
+/**
+ * Bind the arena memory to a NUMA node: the preallocated arena
+ * and all slabs mapped later are preferably allocated on @a node.
+ * Already touched pages of the preallocated arena are migrated.
+ *
+ * A slab_arena keeps a single cache of slabs, so to get node-local
+ * slabs create an arena per node (they may share one quota) and
+ * use a slab_cache on top of the arena of the node the owner
+ * thread runs on.
+ *
+ * @retval 0 on success
+ * @retval -1 if NUMA is not supported or @a node is invalid
+ */
+int
+slab_arena_bind_node(struct slab_arena *arena, int node);
+
+/**
+ * Set a pointer to the root of the data stored in a file backed
+ * arena. The pointer is persisted in the file header.
+ */
+void
+slab_arena_set_root(struct slab_arena *arena, void *root);
+
+/**
+ * Get the pointer set by slab_arena_set_root(). Returns NULL
+ * for a newly initialized file.
+ */
+void *
+slab_arena_root(struct slab_arena *arena);
+
+/**
+ * Get arena statistics. Cheap, each counter is read atomically,
+ * but the counters are not a consistent snapshot if the arena
+ * is used concurrently.
+ */
+void
+slab_arena_stats(struct slab_arena *arena, struct slab_arena_stats *stats);
+
 /** mprotect() the preallocated arena. */
 void
 slab_arena_mprotect(struct slab_arena *arena);
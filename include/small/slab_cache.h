@@ -36,6 +36,8 @@
 #include <assert.h>
 #include "rlist.h"
 #include "slab_arena.h"
+#define RB_COMPACT 1
+#include "rb.h"
 #include <pthread.h>
 
 #if defined(__cplusplus)
@@ -53,7 +55,11 @@ struct slab {
 	 * cache->allocated list.
 	 */
 	struct rlist next_in_cache;
-	/** Next slab in slab_list->slabs list. */
+	/**
+	 * Next slab in slab_list->slabs list. In the slab cache
+	 * only free slabs of the largest order are listed, smaller
+	 * free slabs are tracked by the buddy bitmap.
+	 */
 	struct rlist next_in_list;
 	/**
 	 * Allocated size.
@@ -67,13 +73,18 @@ struct slab {
 	/** Base of lb(size) for ordered slabs. */
 	uint8_t order;
 	/**
-	 * Only used for buddy slabs. If the buddy of the current
-	 * free slab is also free, both slabs are merged and
-	 * a free slab of the higher order emerges.
 	 * Value of 0 means the slab is free. Otherwise
-	 * slab->in_use is set to slab->order + 1.
+	 * slab->in_use is set to slab->order + 1. Only
+	 * meaningful for used slabs and free slabs of the
+	 * largest order: the header of a smaller free slab
+	 * is never read, see struct slab_chunk.
 	 */
 	uint8_t in_use;
+	/**
+	 * True if a free slab of the largest order is excluded
+	 * from child processes, see slab_arena_dontfork().
+	 */
+	bool is_dontfork;
 };
 
 /** Allocation statistics. */
@@ -125,6 +136,82 @@ slab_list_create(struct slab_list *list)
  */
 enum { ORDER_MAX = 16 };
 
+/**
+ * Max number of arena slabs a slab cache may map at once
+ * when it runs out of free slabs, see slab_cache_set_refill_max().
+ */
+enum { SLAB_CACHE_REFILL_MAX = 8 };
+
+/**
+ * Max number of free large slabs a slab cache keeps mapped
+ * for reuse.
+ */
+enum { SLAB_CACHE_LARGE_RETAIN_MAX = 4 };
+
+/**
+ * How many free slabs of the largest order a slab cache keeps
+ * instead of returning them to the arena. Smaller free slabs
+ * are always kept: they are parts of arena slabs in use.
+ */
+struct slab_cache_retention {
+	/** The number of free arena slabs always kept. */
+	uint32_t min_retained;
+	/**
+	 * Max bytes of free arena slabs kept above
+	 * min_retained.
+	 */
+	size_t max_retained;
+	/**
+	 * Free arena slabs above min_retained which are not
+	 * reused for this many seconds are returned to the
+	 * arena, 0 disables the decay.
+	 */
+	double decay;
+};
+
+/** Efficiency of the slab recycling for a slab order. */
+struct slab_cache_counters {
+	/** Allocations served by slabs kept in the cache. */
+	uint64_t hits;
+	/**
+	 * Allocations which had to get memory from the
+	 * arena, or map a new slab for large slabs.
+	 */
+	uint64_t misses;
+	/** Slabs of this order split in two. */
+	uint64_t splits;
+	/** Pairs of buddies of this order merged. */
+	uint64_t merges;
+};
+
+/** Occupancy of a slab order, see slab_cache_stats(). */
+struct slab_order_stats {
+	/** Free slabs, not counting the parts of split ones. */
+	size_t free;
+	/** Slabs in use. */
+	size_t used;
+	struct slab_cache_counters counters;
+};
+
+struct slab_cache_stats {
+	/** Stats of orders from 0 to order_count - 1. */
+	struct slab_order_stats orders[ORDER_MAX + 1];
+	uint8_t order_count;
+	/**
+	 * The largest order which has a free slab, -1 if none.
+	 * If slab_get_with_order() of a higher order fails while
+	 * smaller free slabs exist, the memory is fragmented
+	 * rather than exhausted.
+	 */
+	int largest_free_order;
+	/** Hits and misses of large slabs. */
+	struct slab_cache_counters large;
+};
+
+/** Buddy metadata of a split arena slab, see slab_cache.c. */
+struct slab_chunk;
+typedef rb_tree(struct slab_chunk) slab_chunk_tree_t;
+
 struct slab_cache {
 	/* The source of allocations for this cache. */
 	struct slab_arena *arena;
@@ -158,12 +245,84 @@ struct slab_cache {
 	 */
 	struct slab_list allocated;
 	/**
-	 * Lists of unused slabs, for each slab order.
+	 * Lists of unused slabs, for each slab order. The list of
+	 * the largest order links free arena slabs themselves,
+	 * the lists of smaller orders link the buddy metadata of
+	 * split arena slabs which have a free slab of this order.
 	 *
-	 * A used slab is removed from the list and its
-	 * next_in_list link may be reused for some other purpose.
+	 * A used slab's next_in_list link may be reused for some
+	 * other purpose.
 	 */
 	struct slab_list orders[ORDER_MAX+1];
+	/**
+	 * Free large slabs kept mapped for reuse, most recently
+	 * freed first. They stay in the allocated list and are
+	 * charged to the quota until unmapped.
+	 */
+	struct slab_list large_free;
+	/**
+	 * Retention policy of free arena slabs, by default
+	 * just one free slab is kept.
+	 * @sa slab_cache_set_retention()
+	 */
+	struct slab_cache_retention retention;
+	/** The number of free arena slabs in the cache. */
+	uint32_t retained;
+	/** The lowest value of retained during this decay period. */
+	uint32_t retained_low;
+	/** The start of this decay period, see quota_clock(). */
+	double retained_tick;
+	/**
+	 * Hits and misses for each slab order, the last
+	 * element is for large slabs.
+	 */
+	struct slab_cache_counters counters[ORDER_MAX + 2];
+	/** The number of split arena slabs. */
+	uint32_t chunks;
+	/**
+	 * The buddy metadata of split arena slabs, by the
+	 * arena slab address.
+	 */
+	slab_chunk_tree_t chunk_tree;
+	/**
+	 * Slabs of meta_order keeping the buddy metadata, the
+	 * ones with free room first. They are accounted in the
+	 * total but not the used stats of meta_order.
+	 */
+	struct rlist meta;
+	/** The number of slabs in the meta list. */
+	uint32_t meta_slabs;
+	/** The order of the slabs in the meta list. */
+	uint8_t meta_order;
+	/**
+	 * The number of arena slabs to map on the next refill.
+	 * Doubles on each refill up to refill_max while the
+	 * cache grows and drops to 1 once a slab is returned
+	 * to the arena.
+	 */
+	uint8_t refill_batch;
+	/**
+	 * The largest refill batch, 1 by default.
+	 * @sa slab_cache_set_refill_max()
+	 */
+	uint8_t refill_max;
+	/**
+	 * Requests a shrink on slab_arena_shrink(), once
+	 * registered with slab_arena_add_shrinker().
+	 */
+	struct slab_arena_shrinker shrinker;
+	/**
+	 * Slabs freed by other threads with slab_put_remote(),
+	 * linked through slab::next_in_list.next. Any thread
+	 * pushes, the owner thread takes all slabs at once.
+	 */
+	struct rlist *remote_free;
+	/**
+	 * Set by the shrinker in any thread, the owner thread
+	 * clears it and calls slab_cache_shrink() along with
+	 * draining remote_free.
+	 */
+	bool shrink_requested;
 #ifndef NDEBUG
 	pthread_t thread_id;
 #endif
@@ -175,6 +334,45 @@ slab_cache_create(struct slab_cache *cache, struct slab_arena *arena);
 void
 slab_cache_destroy(struct slab_cache *cache);
 
+/**
+ * Let a growing cache map up to @a refill_max arena slabs at
+ * once, at most SLAB_CACHE_REFILL_MAX. The slabs mapped ahead
+ * are charged to the quota, so a batch never takes more than
+ * half of the quota headroom left.
+ */
+void
+slab_cache_set_refill_max(struct slab_cache *cache, uint8_t refill_max);
+
+/**
+ * Set the retention policy of free arena slabs. The slabs over
+ * the new limits are returned to the arena right away. The limit
+ * of bytes is then checked when slabs are put back to the cache,
+ * the decay also when slabs are taken from it.
+ */
+void
+slab_cache_set_retention(struct slab_cache *cache,
+			 const struct slab_cache_retention *retention);
+
+/**
+ * Return all free slabs of the largest order to the arena
+ * and unmap the retained free large slabs. Starts a new decay
+ * period of the retention policy.
+ * @return the number of bytes returned.
+ */
+size_t
+slab_cache_shrink(struct slab_cache *cache);
+
+/**
+ * Reuse a cache stored in a file backed arena which has been
+ * re-attached with slab_arena_create_file(), along with all its
+ * slabs. The cache must not have had large slabs (bigger than
+ * the arena slab size), including the free ones it retains, see
+ * slab_cache_shrink(): they are mapped separately from the arena
+ * and do not survive a restart.
+ */
+void
+slab_cache_reattach(struct slab_cache *cache, struct slab_arena *arena);
+
 /**
  * Allocate ordered slab
  * @see slab_order()
@@ -189,7 +387,9 @@ void
 slab_put_with_order(struct slab_cache *cache, struct slab *slab);
 
 /**
- * Allocate large slab.
+ * Allocate large slab. Large slabs are page-granular anonymous
+ * mappings charged to the arena quota. A few free ones are kept
+ * for reuse, see SLAB_CACHE_LARGE_RETAIN_MAX.
  * @pre size > slab_order_size(cache->arena->slab_size)
  */
 struct slab *
@@ -218,6 +418,38 @@ slab_get(struct slab_cache *cache, size_t size);
 void
 slab_put(struct slab_cache *cache, struct slab *slab);
 
+/**
+ * Resize a slab to fit size bytes without copying its data
+ * to a new slab. An ordered slab is grown in place by absorbing
+ * its free buddies or shrunk by giving the upper halves back,
+ * a large slab is remapped, which may move it.
+ *
+ * Returns the resized slab or NULL if the slab can't be resized
+ * this way, e.g. the buddy is in use or the slab has to move
+ * between ordered and large slabs. The slab is intact then,
+ * and the caller is supposed to fall back to slab_get(), copy
+ * the data it needs and slab_put() the old slab.
+ */
+struct slab *
+slab_realloc(struct slab_cache *cache, struct slab *slab, size_t size);
+
+/**
+ * Return a slab to a cache from a thread which doesn't own the
+ * cache. Lock-free, the slab is queued and put to the cache in
+ * the owner thread by the next slab_get_with_order(),
+ * slab_get_large() or slab_cache_drain_remote() call.
+ */
+void
+slab_put_remote(struct slab_cache *cache, struct slab *slab);
+
+/**
+ * Put the slabs queued by slab_put_remote() to the cache and
+ * shrink the cache if slab_arena_shrink() requested it.
+ * Must be called in the owner thread.
+ */
+void
+slab_cache_drain_remote(struct slab_cache *cache);
+
 /**
  * Return the number of bytes used by this slab cache.
  * @remark This function is thread-safe.
@@ -268,6 +500,13 @@ slab_from_data(void *data)
 	return (struct slab *) ((char *) data - slab_sizeof());
 }
 
+/**
+ * Get per-order occupancy and fragmentation stats. Doesn't
+ * walk the slabs, so it's cheap enough to call often.
+ */
+void
+slab_cache_stats(struct slab_cache *cache, struct slab_cache_stats *stats);
+
 void
 slab_cache_check(struct slab_cache *cache);
 
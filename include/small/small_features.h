@@ -32,6 +32,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -43,6 +44,12 @@ extern "C" {
 enum {
 	/* To check if SLAB_ARENA_DONTDUMP is supported */
 	SMALL_FEATURE_DONTDUMP		= 0,
+	/* To check if SLAB_ARENA_HUGEPAGE can get huge pages */
+	SMALL_FEATURE_HUGEPAGE		= 1,
+	/* To check if SLAB_ARENA_THP is supported */
+	SMALL_FEATURE_THP		= 2,
+	/* To check if slab_arena_bind_node() is supported */
+	SMALL_FEATURE_NUMA		= 3,
 
 	FEATURE_MAX
 };
@@ -53,6 +60,13 @@ enum {
 bool
 small_test_feature(unsigned int feature);
 
+/**
+ * Return size of a default huge page in bytes, or 0 if it
+ * can't be determined (no huge pages support on this system).
+ */
+size_t
+small_gethugepagesize(void);
+
 #if defined(__cplusplus)
 } /* extern "C" */
 #endif
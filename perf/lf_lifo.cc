@@ -0,0 +1,175 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "lf_lifo.h"
+#include "lf_lifo2.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <benchmark/benchmark.h>
+
+enum {
+	/** The number of elements a thread pops before pushing them. */
+	ELEM_BATCH = 8,
+	/** Max number of threads in a benchmark. */
+	THREADS_MAX = 64,
+	/**
+	 * Max number of elements a thread pops before pushing
+	 * them back in the oscillation benchmarks, like slabs
+	 * in test/arena_mt.c.
+	 */
+	OSCILLATION = 16,
+	/** lf_lifo elements must be aligned by 64KB. */
+	ELEM_ALIGN = 0x10000,
+	ELEM_COUNT = THREADS_MAX * OSCILLATION,
+};
+
+static struct lf_lifo lifo;
+static struct lf_lifo2 lifo2;
+static struct lf_lifo_elim elim;
+
+static void
+lf_lifo_mt_benchmark(benchmark::State& state)
+{
+	void *elems[ELEM_BATCH];
+	for (auto _ : state) {
+		for (int i = 0; i < ELEM_BATCH; i++)
+			elems[i] = lf_lifo_pop(&lifo);
+		for (int i = 0; i < ELEM_BATCH; i++)
+			lf_lifo_push(&lifo, elems[i]);
+	}
+	state.SetItemsProcessed(state.iterations() * ELEM_BATCH);
+}
+
+static void
+lf_lifo2_mt_benchmark(benchmark::State& state)
+{
+	void *elems[ELEM_BATCH];
+	for (auto _ : state) {
+		for (int i = 0; i < ELEM_BATCH; i++)
+			elems[i] = lf_lifo2_pop(&lifo2);
+		for (int i = 0; i < ELEM_BATCH; i++)
+			lf_lifo2_push(&lifo2, elems[i]);
+	}
+	state.SetItemsProcessed(state.iterations() * ELEM_BATCH);
+}
+
+/**
+ * Pop a random number of elements and push them back, as
+ * threads of test/arena_mt.c do with slabs.
+ */
+template <class Stack, void *(*pop)(Stack *), void (*push)(Stack *, void *)>
+static void
+lf_lifo_oscillation(benchmark::State& state, Stack *stack)
+{
+	void *elems[OSCILLATION];
+	unsigned int seed = (uintptr_t)pthread_self();
+	int64_t items = 0;
+	for (auto _ : state) {
+		int oscillation = rand_r(&seed) % OSCILLATION + 1;
+		int n = 0;
+		while (n < oscillation && (elems[n] = pop(stack)) != NULL)
+			n++;
+		items += n;
+		while (n > 0)
+			push(stack, elems[--n]);
+	}
+	state.SetItemsProcessed(items);
+}
+
+static void
+lf_lifo_push_void(struct lf_lifo *head, void *elem)
+{
+	lf_lifo_push(head, elem);
+}
+
+static void
+lf_lifo_oscillation_benchmark(benchmark::State& state)
+{
+	lf_lifo_oscillation<struct lf_lifo, lf_lifo_pop,
+			    lf_lifo_push_void>(state, &lifo);
+}
+
+static void
+lf_lifo_elim_oscillation_benchmark(benchmark::State& state)
+{
+	lf_lifo_oscillation<struct lf_lifo_elim, lf_lifo_elim_pop,
+			    lf_lifo_elim_push>(state, &elim);
+}
+
+BENCHMARK(lf_lifo_mt_benchmark)
+	->ThreadRange(1, THREADS_MAX)
+	->UseRealTime();
+
+BENCHMARK(lf_lifo2_mt_benchmark)
+	->ThreadRange(1, THREADS_MAX)
+	->UseRealTime();
+
+BENCHMARK(lf_lifo_oscillation_benchmark)
+	->Threads(8)->Threads(16)->Threads(64)
+	->UseRealTime();
+
+BENCHMARK(lf_lifo_elim_oscillation_benchmark)
+	->Threads(8)->Threads(16)->Threads(64)
+	->UseRealTime();
+
+int main(int argc, char** argv)
+{
+	/*
+	 * Only the first word of an element is touched, so the
+	 * aligned elements take little memory.
+	 */
+	size_t size = 2 * (size_t)ELEM_COUNT * ELEM_ALIGN;
+	char *map = (char *)mmap(NULL, size + ELEM_ALIGN,
+				 PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return 1;
+	char *elems = (char *)(((uintptr_t)map + ELEM_ALIGN - 1) &
+			       ~(uintptr_t)(ELEM_ALIGN - 1));
+	lf_lifo_init(&lifo);
+	lf_lifo2_init(&lifo2);
+	lf_lifo_elim_init(&elim);
+	for (int i = 0; i < ELEM_COUNT; i++) {
+		lf_lifo_push(&lifo, elems + (size_t)i * ELEM_ALIGN);
+		lf_lifo_elim_push(&elim,
+				  elems + (size_t)(ELEM_COUNT + i) * ELEM_ALIGN);
+	}
+	/* lf_lifo2 elements are packed, as in an object free list. */
+	static void *elems2[ELEM_COUNT];
+	for (int i = 0; i < ELEM_COUNT; i++)
+		lf_lifo2_push(&lifo2, &elems2[i]);
+	::benchmark::Initialize(&argc, argv);
+	if (::benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	::benchmark::RunSpecifiedBenchmarks();
+	munmap(map, size + ELEM_ALIGN);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "slab_arena.h"
+#include "quota.h"
+
+#include <benchmark/benchmark.h>
+
+enum {
+	/**
+	 * The number of slabs a thread maps before unmapping them,
+	 * more than a magazine holds to exercise the depot.
+	 */
+	SLAB_BATCH = 3 * SLAB_MAGAZINE_SIZE / 2,
+	/** Max number of threads in a benchmark. */
+	THREADS_MAX = 64,
+};
+
+static struct slab_arena arena;
+static struct quota quota;
+
+static void
+slab_arena_mt_benchmark(benchmark::State& state)
+{
+	void *slabs[SLAB_BATCH];
+	for (auto _ : state) {
+		for (int i = 0; i < SLAB_BATCH; i++)
+			slabs[i] = slab_map(&arena);
+		for (int i = 0; i < SLAB_BATCH; i++)
+			slab_unmap(&arena, slabs[i]);
+	}
+	state.SetItemsProcessed(state.iterations() * SLAB_BATCH);
+}
+
+static void
+slab_thread_cache_mt_benchmark(benchmark::State& state)
+{
+	void *slabs[SLAB_BATCH];
+	struct slab_thread_cache cache;
+	slab_thread_cache_create(&cache, &arena);
+	for (auto _ : state) {
+		for (int i = 0; i < SLAB_BATCH; i++)
+			slabs[i] = slab_thread_cache_map(&cache);
+		for (int i = 0; i < SLAB_BATCH; i++)
+			slab_thread_cache_unmap(&cache, slabs[i]);
+	}
+	slab_thread_cache_destroy(&cache);
+	state.SetItemsProcessed(state.iterations() * SLAB_BATCH);
+}
+
+BENCHMARK(slab_arena_mt_benchmark)
+	->ThreadRange(1, THREADS_MAX)
+	->UseRealTime();
+
+BENCHMARK(slab_thread_cache_mt_benchmark)
+	->ThreadRange(1, THREADS_MAX)
+	->UseRealTime();
+
+int main(int argc, char** argv)
+{
+	size_t maxalloc = THREADS_MAX *
+		(SLAB_BATCH + 2 * SLAB_MAGAZINE_SIZE) * SLAB_MIN_SIZE;
+	quota_init(&quota, maxalloc);
+	slab_arena_create(&arena, &quota, 0, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	::benchmark::Initialize(&argc, argv);
+	if (::benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	::benchmark::RunSpecifiedBenchmarks();
+	slab_arena_destroy(&arena);
+}
@@ -89,14 +89,29 @@ ibuf_reserve_slow(struct ibuf *ibuf, size_t size)
 		while (new_capacity < used + size)
 			new_capacity *= 2;
 
-		struct slab *slab = slab_get(ibuf->slabc, new_capacity);
-		if (slab == NULL)
-			return NULL;
-		char *ptr = (char *) slab_data(slab);
-		memcpy(ptr, ibuf->rpos, used);
-		if (ibuf->buf)
-			slab_put(ibuf->slabc, slab_from_data(ibuf->buf));
-		ibuf->buf = ptr;
+		/* Try to grow the buffer without copying it first. */
+		struct slab *slab = NULL;
+		if (ibuf->buf != NULL) {
+			size_t offset = ibuf->rpos - ibuf->buf;
+			slab = slab_realloc(ibuf->slabc,
+					    slab_from_data(ibuf->buf),
+					    new_capacity);
+			if (slab != NULL) {
+				ibuf->buf = (char *) slab_data(slab);
+				memmove(ibuf->buf, ibuf->buf + offset, used);
+			}
+		}
+		if (slab == NULL) {
+			slab = slab_get(ibuf->slabc, new_capacity);
+			if (slab == NULL)
+				return NULL;
+			char *ptr = (char *) slab_data(slab);
+			memcpy(ptr, ibuf->rpos, used);
+			if (ibuf->buf)
+				slab_put(ibuf->slabc,
+					 slab_from_data(ibuf->buf));
+			ibuf->buf = ptr;
+		}
 		ibuf->end = ibuf->buf + slab_capacity(slab);
 	}
 	ibuf->rpos = ibuf->buf;
@@ -125,14 +140,22 @@ ibuf_shrink(struct ibuf *ibuf)
 	    slab_real_size(ibuf->slabc, new_capacity))
 		return;
 
-	struct slab *slab = slab_get(ibuf->slabc, new_capacity);
-	if (slab == NULL)
-		return;
+	/* Try to shrink the buffer in place first. */
+	memmove(ibuf->buf, ibuf->rpos, used);
+	ibuf->rpos = ibuf->buf;
+	ibuf->wpos = ibuf->buf + used;
+	struct slab *slab = slab_realloc(ibuf->slabc,
+					 slab_from_data(ibuf->buf),
+					 new_capacity);
+	if (slab == NULL) {
+		slab = slab_get(ibuf->slabc, new_capacity);
+		if (slab == NULL)
+			return;
+		memcpy(slab_data(slab), ibuf->rpos, used);
+		slab_put(ibuf->slabc, slab_from_data(ibuf->buf));
+	}
 
 	char *ptr = (char *)slab_data(slab);
-	memcpy(ptr, ibuf->rpos, used);
-	if (ibuf->buf)
-		slab_put(ibuf->slabc, slab_from_data(ibuf->buf));
 	ibuf->buf = ptr;
 	ibuf->rpos = ptr;
 	ibuf->wpos = ptr + used;
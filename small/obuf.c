@@ -182,15 +182,19 @@ obuf_reserve_slow(struct obuf *buf, size_t size)
 	/* Make sure the next buffer can store size. */
 	if (size > capacity) {
 		if (capacity > 0) {
-			/* Simply realloc. */
+			/* Simply realloc, in place if possible. */
 			while (capacity < size)
 				capacity = capacity * 2;
-			struct slab *slab = slab_get(buf->slabc, capacity);
-			if (slab == NULL)
-				return NULL;
 			struct slab *old =
 				slab_from_data(buf->iov[buf->pos].iov_base);
-			slab_put(buf->slabc, old);
+			struct slab *slab = slab_realloc(buf->slabc, old,
+							 capacity);
+			if (slab == NULL) {
+				slab = slab_get(buf->slabc, capacity);
+				if (slab == NULL)
+					return NULL;
+				slab_put(buf->slabc, old);
+			}
 			buf->iov[buf->pos].iov_base = slab_data(slab);
 			buf->capacity[buf->pos] = slab_capacity(slab);
 		} else if (obuf_alloc_pos(buf, size) == NULL) {
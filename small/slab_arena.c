@@ -31,16 +31,48 @@
 #include "slab_arena.h"
 #include "small_config.h"
 #include "quota.h"
+#include "util.h"
+#include "small_features.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <pmatomic.h>
 #include <valgrind/valgrind.h>
 #include <valgrind/memcheck.h>
+#ifdef TARANTOOL_SMALL_HAVE_MBIND
+#include <sys/syscall.h>
+#endif
+
+/* Memory policy constants, see <numaif.h>. */
+enum {
+	SMALL_MPOL_PREFERRED	= 1,
+	SMALL_MPOL_MF_MOVE	= 1 << 1,
+};
+
+/**
+ * Update an arena statistics counter. The counters are only
+ * read for monitoring, so relaxed atomics are enough.
+ */
+static inline void
+slab_arena_stat_add(size_t *counter, size_t value)
+{
+	pm_atomic_fetch_add_explicit(counter, value, pm_memory_order_relaxed);
+}
+
+static inline void
+slab_arena_stat_sub(size_t *counter, size_t value)
+{
+	pm_atomic_fetch_sub_explicit(counter, value, pm_memory_order_relaxed);
+}
 
 static void
 madvise_checked(void *ptr, size_t size, int flags)
@@ -69,6 +101,41 @@ madvise_checked(void *ptr, size_t size, int flags)
 #endif
 }
 
+/**
+ * Set a memory policy for the area to prefer allocating
+ * its pages on the given NUMA node.
+ */
+static int
+mbind_checked(void *ptr, size_t size, int node, unsigned flags)
+{
+	assert(node >= 0 && node < SLAB_ARENA_NODE_MAX);
+#ifdef TARANTOOL_SMALL_HAVE_MBIND
+	enum { BITS = CHAR_BIT * sizeof(unsigned long) };
+	unsigned long mask[SLAB_ARENA_NODE_MAX / BITS];
+	memset(mask, 0, sizeof(mask));
+	mask[node / BITS] |= 1UL << (node % BITS);
+	/* The kernel expects maxnode to be one more than needed. */
+	if (syscall(SYS_mbind, ptr, size, SMALL_MPOL_PREFERRED, mask,
+		    SLAB_ARENA_NODE_MAX + 1, flags) != 0) {
+		intptr_t ignore_it;
+		char buf[64];
+
+		ignore_it = (intptr_t)strerror_r(errno, buf, sizeof(buf));
+		(void)ignore_it;
+
+		fprintf(stderr, "Error in mbind(%p, %zu, node %d): %s\n",
+			ptr, size, node, buf);
+		return -1;
+	}
+	return 0;
+#else
+	(void)ptr;
+	(void)size;
+	(void)flags;
+	return -1;
+#endif
+}
+
 static void
 munmap_checked(void *addr, size_t size)
 {
@@ -84,29 +151,27 @@ munmap_checked(void *addr, size_t size)
 }
 
 static void *
-mmap_checked(size_t size, size_t align, int flags)
+mmap_checked(size_t size, size_t align, int prot, int flags,
+	     struct slab_arena_stats *stats)
 {
 	/* The alignment must be a power of two. */
 	assert((align & (align - 1)) == 0);
 	/* The size must be a multiple of alignment */
 	assert((size & (align - 1)) == 0);
 
-	if (IS_SLAB_ARENA_FLAG(flags, SLAB_ARENA_PRIVATE))
-		flags = MAP_PRIVATE | MAP_ANONYMOUS;
-	else
-		flags = MAP_SHARED | MAP_ANONYMOUS;
-
 	/*
 	 * All mappings except the first are likely to
 	 * be aligned already.  Be optimistic by trying
 	 * to map exactly the requested amount.
 	 */
-	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	slab_arena_stat_add(&stats->mmap_calls, 1);
+	void *map = mmap(NULL, size, prot, flags, -1, 0);
 	if (map == MAP_FAILED)
 		return NULL;
 	if (((intptr_t) map & (align - 1)) == 0)
 		return map;
 	munmap_checked(map, size);
+	slab_arena_stat_add(&stats->misaligned_retries, 1);
 
 	/*
 	 * mmap enough amount to be able to align
@@ -114,7 +179,7 @@ mmap_checked(size_t size, size_t align, int flags)
 	 * fragmentation depending on the kernels allocation
 	 * strategy.
 	 */
-	map = mmap(NULL, size + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+	map = mmap(NULL, size + align, prot, flags, -1, 0);
 	if (map == MAP_FAILED)
 		return NULL;
 
@@ -133,6 +198,113 @@ mmap_checked(size_t size, size_t align, int flags)
 	return map;
 }
 
+/**
+ * Advise the kernel to back the area with transparent huge
+ * pages. Returns true on success.
+ */
+static bool
+madvise_hugepage(void *ptr, size_t size, int flags)
+{
+#ifdef TARANTOOL_SMALL_USE_THP
+	if (!IS_SLAB_ARENA_FLAG(flags, SLAB_ARENA_THP))
+		return false;
+	return madvise(ptr, size, MADV_HUGEPAGE) == 0;
+#else
+	(void)ptr;
+	(void)size;
+	(void)flags;
+	return false;
+#endif
+}
+
+/** mmap(2) flags of the arena memory. */
+static int
+slab_arena_mmap_flags(struct slab_arena *arena)
+{
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_PRIVATE))
+		return MAP_PRIVATE | MAP_ANONYMOUS;
+	else
+		return MAP_SHARED | MAP_ANONYMOUS;
+}
+
+/**
+ * Map an area of memory for the arena aligned by the slab size,
+ * honoring the arena flags. Sets @a is_huge if the area is backed
+ * by huge pages.
+ */
+static void *
+slab_arena_mmap(struct slab_arena *arena, size_t size, bool *is_huge)
+{
+	int flags = slab_arena_mmap_flags(arena);
+	void *map = NULL;
+	*is_huge = false;
+#ifdef TARANTOOL_SMALL_HAVE_MAP_HUGETLB
+	/*
+	 * No huge pages may be reserved in the system or they all
+	 * may be already in use, fall back to regular pages then.
+	 */
+	if (arena->hugepage_size != 0) {
+		map = mmap_checked(size, arena->slab_size,
+				   PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+				   &arena->stats);
+		*is_huge = map != NULL;
+	}
+#endif
+	if (map == NULL) {
+		map = mmap_checked(size, arena->slab_size,
+				   PROT_READ | PROT_WRITE, flags, &arena->stats);
+		if (map == NULL)
+			return NULL;
+		*is_huge = madvise_hugepage(map, size, arena->flags);
+	}
+	madvise_checked(map, size, arena->flags);
+	if (arena->node >= 0)
+		mbind_checked(map, size, arena->node, 0);
+	return map;
+}
+
+/**
+ * Reserve an area of address space for the arena aligned by the
+ * slab size. The area is inaccessible and takes no memory until
+ * it is committed with slab_arena_commit(). Sets @a is_huge if
+ * the area is advised to be backed by huge pages.
+ */
+static void *
+slab_arena_reserve(struct slab_arena *arena, size_t size, bool *is_huge)
+{
+	int flags = slab_arena_mmap_flags(arena);
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	void *map = mmap_checked(size, arena->slab_size, PROT_NONE, flags,
+				 &arena->stats);
+	if (map == NULL)
+		return NULL;
+	/*
+	 * The advice sticks to the mapping and is inherited by
+	 * the committed parts of the area, so give it once.
+	 */
+	*is_huge = madvise_hugepage(map, size, arena->flags);
+	madvise_checked(map, size, arena->flags);
+	return map;
+}
+
+/** Make a part of the reserved area accessible. */
+static int
+slab_arena_commit(void *ptr, size_t size)
+{
+	if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+		char buf[64];
+		intptr_t ignore_it = (intptr_t)strerror_r(errno, buf,
+							  sizeof(buf));
+		(void)ignore_it;
+		fprintf(stderr, "Error in mprotect(%p, %zu): %s\n",
+			ptr, size, buf);
+		return -1;
+	}
+	return 0;
+}
+
 #if 0
 /** This is a way to round things up without using a built-in. */
 static size_t
@@ -148,12 +320,157 @@ pow2round(size_t size)
 }
 #endif
 
+/**
+ * Header of a slab in the arena cache. It is placed in the first
+ * page of the slab, which is never purged, so that the slab can
+ * be safely linked in the cache regardless of its state.
+ */
+struct slab_cached {
+	/** Link in arena->cache. Must be the first member. */
+	struct lf_lifo next;
+	/** Time when the slab was put into the cache. */
+	double unmap_time;
+	/** True if the slab memory is returned to the OS. */
+	bool is_purged;
+};
+
+/**
+ * A full magazine in the arena depot. It is stored in the
+ * first slab of the magazine.
+ */
+struct slab_depot_entry {
+	/** Link in arena->depot. Must be the first member. */
+	struct lf_lifo next;
+	/** Time when the magazine was put into the depot. */
+	double put_time;
+	/** The rest of the magazine slabs. */
+	void *slabs[SLAB_MAGAZINE_SIZE - 1];
+};
+
+/** Background thread which trims the arena periodically. */
+struct slab_arena_purger {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Seconds between two slab_arena_trim() calls. */
+	double period;
+	/** Set to stop the thread. */
+	bool is_stopped;
+};
+
+/** "slabarna" */
+static const uint64_t SLAB_ARENA_HEADER_MAGIC = 0x736c616261726e61ULL;
+static const uint32_t SLAB_ARENA_HEADER_VERSION = 1;
+
+/**
+ * Header of a file backed arena, stored in the first slab of
+ * the file. It keeps the arena state between two processes
+ * attaching the file.
+ */
+struct slab_arena_header {
+	uint64_t magic;
+	uint32_t version;
+	/** Set while the file is attached. */
+	bool is_dirty;
+	/** The address the file is mapped at. */
+	void *base;
+	/** Size of the file. */
+	size_t size;
+	uint32_t slab_size;
+	/** Copy of arena->used. */
+	size_t used;
+	/** Copy of arena->cache. */
+	struct lf_lifo cache;
+	/** See slab_arena_set_root(). */
+	void *root;
+};
+
+static inline double
+slab_arena_clock(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/** Fault in all pages of an area keeping its contents. */
 static void
+prefault_range(char *ptr, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	/*
+	 * A locked no-op write faults a page in for writing at
+	 * once, and doesn't change the data of a file backed arena.
+	 */
+	size_t page_size = small_getpagesize();
+	char *end = ptr + size;
+	for (; ptr < end; ptr += page_size)
+		__sync_fetch_and_or(ptr, 0);
+}
+
+struct prefault_job {
+	pthread_t thread;
+	char *ptr;
+	size_t size;
+};
+
+static void *
+prefault_f(void *arg)
+{
+	struct prefault_job *job = (struct prefault_job *)arg;
+	prefault_range(job->ptr, job->size);
+	return NULL;
+}
+
+/**
+ * Fault in the preallocated arena splitting it between
+ * a thread per CPU.
+ */
+static void
+slab_arena_prefault(struct slab_arena *arena)
+{
+	enum { PREFAULT_THREADS_MAX = 32 };
+	struct prefault_job jobs[PREFAULT_THREADS_MAX];
+	size_t slab_count = arena->prealloc / arena->slab_size;
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t job_count = MAX(cpu_count, 1);
+	job_count = MIN(job_count, PREFAULT_THREADS_MAX);
+	job_count = MIN(job_count, slab_count);
+	if (job_count == 0)
+		return;
+	/*
+	 * Split the arena by slabs, the threads take chunks from
+	 * the end, the caller takes the rest.
+	 */
+	size_t chunk = slab_count / job_count * arena->slab_size;
+	char *end = (char *)arena->arena + arena->prealloc;
+	size_t started, i;
+	for (started = 0; started < job_count - 1; started++) {
+		struct prefault_job *job = &jobs[started];
+		job->ptr = end - chunk * (started + 1);
+		job->size = chunk;
+		if (pthread_create(&job->thread, NULL, prefault_f, job) != 0)
+			break;
+	}
+	prefault_range(arena->arena, arena->prealloc - chunk * started);
+	for (i = 0; i < started; i++)
+		pthread_join(jobs[i].thread, NULL);
+}
+
+static int
 slab_arena_flags_init(struct slab_arena *arena, int flags)
 {
+	arena->hugepage_size = 0;
 	/*
 	 * Old interface for backward compatibility, MAP_
 	 * flags are passed directly without SLAB_ARENA_FLAG_MARK,
@@ -165,18 +482,36 @@ slab_arena_flags_init(struct slab_arena *arena, int flags)
 			arena->flags = SLAB_ARENA_PRIVATE;
 		else
 			arena->flags = SLAB_ARENA_SHARED;
-		return;
+		return 0;
 	}
 
 	assert(IS_SLAB_ARENA_FLAG(flags, SLAB_ARENA_PRIVATE) ||
 	       IS_SLAB_ARENA_FLAG(flags, SLAB_ARENA_SHARED));
 
 	arena->flags = flags;
+
+#ifdef TARANTOOL_SMALL_HAVE_MAP_HUGETLB
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_HUGEPAGE)) {
+		/*
+		 * Explicit huge pages can only be used if every
+		 * mapping is a multiple of the huge page size.
+		 */
+		size_t hugepage_size = small_gethugepagesize();
+		if (hugepage_size != 0 &&
+		    arena->slab_size % hugepage_size != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		arena->hugepage_size = hugepage_size;
+	}
+#endif
+	return 0;
 }
 
-int
-slab_arena_create(struct slab_arena *arena, struct quota *quota,
-		  size_t prealloc, uint32_t slab_size, int flags)
+/** Initialize the arena fields common for all kinds of arenas. */
+static int
+slab_arena_init(struct slab_arena *arena, struct quota *quota,
+		uint32_t slab_size, int flags)
 {
 	lf_lifo_init(&arena->cache);
 	VALGRIND_MAKE_MEM_DEFINED(&arena->cache, sizeof(struct lf_lifo));
@@ -189,78 +524,404 @@ slab_arena_create(struct slab_arena *arena, struct quota *quota,
 	arena->slab_size = small_round(MAX(slab_size, SLAB_MIN_SIZE));
 
 	arena->quota = quota;
+	arena->arena = NULL;
+	arena->prealloc = 0;
+	arena->reserved = 0;
+	arena->used = 0;
+	arena->lost = 0;
+	memset(&arena->stats, 0, sizeof(arena->stats));
+	arena->prealloc_is_huge = false;
+	arena->node = -1;
+	arena->purge_delay = 0;
+	arena->purge_watermark = 0;
+	arena->purger = NULL;
+	arena->header = NULL;
+	lf_lifo_init(&arena->scan);
+	lf_lifo_init(&arena->depot);
+	arena->depot_size = 0;
+	lf_lifo_init(&arena->released);
+	rlist_create(&arena->shrinkers);
+
+	return slab_arena_flags_init(arena, flags);
+}
+
+int
+slab_arena_create(struct slab_arena *arena, struct quota *quota,
+		  size_t prealloc, uint32_t slab_size, int flags)
+{
+	if (slab_arena_init(arena, quota, slab_size, flags) != 0)
+		return -1;
+
 	/** Prealloc can not be greater than the quota */
 	prealloc = MIN(prealloc, quota_total(quota));
 	/** Extremely large sizes can not be aligned properly */
 	prealloc = MIN(prealloc, SIZE_MAX - arena->slab_size);
 	/* Align prealloc around a fixed number of slabs. */
 	arena->prealloc = small_align(prealloc, arena->slab_size);
+	arena->reserved = arena->prealloc;
 
-	arena->used = 0;
+	/*
+	 * Explicit huge pages are reserved in the system pool
+	 * on mmap(), so there is nothing to gain for them.
+	 */
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_RESERVE) &&
+	    arena->hugepage_size == 0) {
+		size_t reserved = MIN(quota_total(quota),
+				      SIZE_MAX - arena->slab_size);
+		reserved = small_align(reserved, arena->slab_size);
+		reserved = MAX(reserved, arena->prealloc);
+		if (reserved != 0) {
+			arena->arena = slab_arena_reserve(
+				arena, reserved, &arena->prealloc_is_huge);
+		}
+		if (arena->arena != NULL) {
+			arena->reserved = reserved;
+			if (arena->prealloc != 0 &&
+			    slab_arena_commit(arena->arena,
+					      arena->prealloc) != 0) {
+				munmap_checked(arena->arena, reserved);
+				arena->arena = NULL;
+				arena->reserved = arena->prealloc;
+			}
+		}
+	}
+	if (arena->arena == NULL && arena->prealloc) {
+		arena->arena = slab_arena_mmap(arena, arena->prealloc,
+					       &arena->prealloc_is_huge);
+	}
+	if (arena->arena != NULL &&
+	    IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_PREFAULT))
+		slab_arena_prefault(arena);
 
-	slab_arena_flags_init(arena, flags);
+	return arena->prealloc && !arena->arena ? -1 : 0;
+}
 
-	if (arena->prealloc) {
-		arena->arena = mmap_checked(arena->prealloc,
-					    arena->slab_size,
-					    arena->flags);
-	} else {
-		arena->arena = NULL;
+int
+slab_arena_create_file(struct slab_arena *arena, struct quota *quota,
+		       int fd, void *base, size_t size, uint32_t slab_size,
+		       int flags)
+{
+	assert(IS_SLAB_ARENA_FLAG(flags, SLAB_ARENA_SHARED));
+	if (slab_arena_init(arena, quota, slab_size, flags) != 0)
+		return -1;
+	/* The header takes the first slab. */
+	if (size > SIZE_MAX - arena->slab_size ||
+	    (uintptr_t)base % arena->slab_size != 0 ||
+	    small_align(size, arena->slab_size) < 2 * arena->slab_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	size = small_align(size, arena->slab_size);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -1;
+	if (st.st_size == 0) {
+		if (ftruncate(fd, size) != 0)
+			return -1;
+	} else if ((size_t)st.st_size != size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int map_flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+	map_flags |= MAP_FIXED_NOREPLACE;
+#endif
+	void *map = mmap(base, size, PROT_READ | PROT_WRITE, map_flags, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	if (map != base) {
+		/* The hint was not honored. */
+		munmap_checked(map, size);
+		errno = EEXIST;
+		return -1;
+	}
+
+	struct slab_arena_header *header = base;
+	if (header->magic == 0) {
+		/* A new file, it is filled with zeros. */
+		header->magic = SLAB_ARENA_HEADER_MAGIC;
+		header->version = SLAB_ARENA_HEADER_VERSION;
+		header->base = base;
+		header->size = size;
+		header->slab_size = arena->slab_size;
+		header->used = 0;
+		lf_lifo_init(&header->cache);
+		header->root = NULL;
+		header->is_dirty = false;
+	}
+	if (header->magic != SLAB_ARENA_HEADER_MAGIC ||
+	    header->version != SLAB_ARENA_HEADER_VERSION ||
+	    header->base != base || header->size != size ||
+	    header->slab_size != arena->slab_size ||
+	    /* The arena was not destroyed properly. */
+	    header->is_dirty) {
+		munmap_checked(map, size);
+		errno = EINVAL;
+		return -1;
+	}
+	if (header->used != 0 && quota_use(quota, header->used) < 0) {
+		munmap_checked(map, size);
+		errno = ENOMEM;
+		return -1;
 	}
 
+	header->is_dirty = true;
+	arena->header = header;
+	arena->arena = (char *)base + arena->slab_size;
+	arena->prealloc = size - arena->slab_size;
+	arena->reserved = arena->prealloc;
+	arena->used = header->used;
+	arena->cache = header->cache;
+	struct lf_lifo *cached;
+	for (cached = lf_lifo(arena->cache.next); cached != NULL;
+	     cached = lf_lifo(cached->next))
+		arena->stats.cached += arena->slab_size;
+	arena->prealloc_is_huge = madvise_hugepage(arena->arena,
+						   arena->prealloc,
+						   arena->flags);
 	madvise_checked(arena->arena, arena->prealloc, arena->flags);
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_PREFAULT))
+		slab_arena_prefault(arena);
+	return 0;
+}
 
-	return arena->prealloc && !arena->arena ? -1 : 0;
+/**
+ * The size of the part of a slab which is never advised to
+ * keep the slab header intact. Explicit huge pages can only
+ * be advised as a whole, so it is the first huge page then.
+ */
+static inline size_t
+slab_header_size(struct slab_arena *arena)
+{
+	return MAX((size_t)small_getpagesize(), arena->hugepage_size);
+}
+
+/** Apply fork advice to a slab except its header. */
+static void
+slab_advise_fork(struct slab_arena *arena, void *ptr, int advice)
+{
+	size_t offset = slab_header_size(arena);
+	if (offset >= arena->slab_size)
+		return;
+	if (madvise((char *)ptr + offset, arena->slab_size - offset,
+		    advice) != 0)
+		slab_arena_stat_add(&arena->stats.fork_advise_failures, 1);
+}
+
+void
+slab_arena_dontfork(struct slab_arena *arena, void *ptr)
+{
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_DONTFORK))
+		slab_advise_fork(arena, ptr, MADV_DONTFORK);
+}
+
+void
+slab_arena_dofork(struct slab_arena *arena, void *ptr)
+{
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_DONTFORK))
+		slab_advise_fork(arena, ptr, MADV_DOFORK);
+}
+
+/**
+ * Put @a count slabs into the cache as if they were unmapped
+ * at @a unmap_time. The last slab goes on top, as with
+ * sequential slab_unmap().
+ */
+static void
+slab_arena_cache_batch(struct slab_arena *arena, void **slabs, size_t count,
+		       double unmap_time)
+{
+	if (count == 0)
+		return;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		struct slab_cached *cached = (struct slab_cached *)slabs[i];
+		assert(lf_lifo(cached) == &cached->next);
+		cached->next.next = i > 0 ? slabs[i - 1] : NULL;
+		cached->unmap_time = unmap_time;
+		cached->is_purged = false;
+		slab_arena_dontfork(arena, cached);
+	}
+	slab_arena_stat_add(&arena->stats.cached, count * arena->slab_size);
+	lf_lifo_push_chain(&arena->cache, slabs[count - 1], slabs[0]);
+	for (i = 0; i < count; i++) {
+		VALGRIND_MAKE_MEM_NOACCESS(slabs[i], arena->slab_size);
+		VALGRIND_MAKE_MEM_DEFINED(slabs[i], sizeof(struct slab_cached));
+	}
+}
+
+/**
+ * Put a full magazine into the depot and empty it. If the depot
+ * is full, the magazine is put into the cache instead.
+ */
+static void
+slab_depot_put(struct slab_arena *arena, struct slab_magazine *magazine)
+{
+	assert(magazine->count == SLAB_MAGAZINE_SIZE);
+	double now = slab_arena_clock();
+	if (pm_atomic_fetch_add(&arena->depot_size, 1) >= SLAB_DEPOT_MAX) {
+		pm_atomic_fetch_sub(&arena->depot_size, 1);
+		slab_arena_cache_batch(arena, magazine->slabs,
+				       magazine->count, now);
+		magazine->count = 0;
+		return;
+	}
+	struct slab_depot_entry *entry = magazine->slabs[0];
+	entry->put_time = now;
+	memcpy(entry->slabs, magazine->slabs + 1, sizeof(entry->slabs));
+	lf_lifo_push(&arena->depot, entry);
+	magazine->count = 0;
+}
+
+/**
+ * Fill an empty magazine with a magazine from the depot.
+ * Returns false if the depot is empty.
+ */
+static bool
+slab_depot_get(struct slab_arena *arena, struct slab_magazine *magazine)
+{
+	assert(magazine->count == 0);
+	struct slab_depot_entry *entry = lf_lifo_pop(&arena->depot);
+	if (entry == NULL)
+		return false;
+	pm_atomic_fetch_sub(&arena->depot_size, 1);
+	magazine->slabs[0] = entry;
+	memcpy(magazine->slabs + 1, entry->slabs, sizeof(entry->slabs));
+	magazine->count = SLAB_MAGAZINE_SIZE;
+	return true;
+}
+
+/**
+ * Move a magazine from the depot to the cache, keeping the time
+ * it was put into the depot. Returns false if the depot is empty.
+ */
+static bool
+slab_depot_spill(struct slab_arena *arena)
+{
+	struct slab_magazine magazine;
+	magazine.count = 0;
+	if (!slab_depot_get(arena, &magazine))
+		return false;
+	struct slab_depot_entry *entry = magazine.slabs[0];
+	slab_arena_cache_batch(arena, magazine.slabs, magazine.count,
+			       entry->put_time);
+	return true;
+}
+
+/** Move all slabs from the depot to the cache. */
+static void
+slab_arena_drain_depot(struct slab_arena *arena)
+{
+	while (slab_depot_spill(arena))
+		;
 }
 
 void
 slab_arena_destroy(struct slab_arena *arena)
 {
+	slab_arena_stop_purge_thread(arena);
+	slab_arena_drain_depot(arena);
+	/* The cache must not be walked concurrently. */
+	assert(lf_lifo(arena->scan.next) == NULL);
+	struct slab_arena_header *header = arena->header;
 	void *ptr;
+	if (header != NULL) {
+		/* Slabs are only reclaimed in anonymous memory. */
+		assert(lf_lifo_is_empty(&arena->released));
+		/* Save the arena state for the next attach. */
+		header->used = arena->used;
+		header->cache = arena->cache;
+		header->is_dirty = false;
+		munmap_checked(header, header->size);
+		return;
+	}
 	size_t total = 0;
-	while ((ptr = lf_lifo_pop(&arena->cache))) {
+	/* Released slabs are counted in @a used like cached ones. */
+	while ((ptr = lf_lifo_pop(&arena->released)) ||
+	       (ptr = lf_lifo_pop(&arena->cache))) {
 		if (arena->arena == NULL || ptr < arena->arena ||
-		    ptr >= arena->arena + arena->prealloc) {
+		    ptr >= arena->arena + arena->reserved) {
 			munmap_checked(ptr, arena->slab_size);
 		}
 		total += arena->slab_size;
 	}
 	if (arena->arena)
-		munmap_checked(arena->arena, arena->prealloc);
+		munmap_checked(arena->arena, arena->reserved);
 
 	(void)total;
-	assert(total == arena->used);
+	assert(total + arena->lost == arena->used);
 }
 
 void *
 slab_map(struct slab_arena *arena)
 {
 	void *ptr;
-	if ((ptr = lf_lifo_pop(&arena->cache))) {
+	do {
+		if ((ptr = lf_lifo_pop(&arena->cache)) ||
+		    (ptr = lf_lifo_pop(&arena->scan))) {
+			slab_arena_stat_add(&arena->stats.cache_hits, 1);
+			slab_arena_stat_sub(&arena->stats.cached,
+					    arena->slab_size);
+			slab_arena_dofork(arena, ptr);
+			VALGRIND_MAKE_MEM_UNDEFINED(ptr, arena->slab_size);
+			return ptr;
+		}
+		/* Reuse free slabs left in the depot by thread caches. */
+	} while (slab_depot_spill(arena));
+
+	if (quota_use(arena->quota, arena->slab_size) < 0) {
+		slab_arena_stat_add(&arena->stats.quota_failures, 1);
+		return NULL;
+	}
+	if ((ptr = lf_lifo_pop(&arena->released))) {
+		slab_arena_dofork(arena, ptr);
 		VALGRIND_MAKE_MEM_UNDEFINED(ptr, arena->slab_size);
 		return ptr;
 	}
 
-	if (quota_use(arena->quota, arena->slab_size) < 0)
-		return NULL;
-
 	/** Need to allocate a new slab. */
 	size_t used = pm_atomic_fetch_add(&arena->used, arena->slab_size);
 	used += arena->slab_size;
 	if (used <= arena->prealloc) {
+		slab_arena_stat_add(&arena->stats.prealloc_hits, 1);
+		ptr = arena->arena + used - arena->slab_size;
+		if (arena->prealloc_is_huge)
+			slab_arena_stat_add(&arena->stats.hugepage_slabs, 1);
+		VALGRIND_MAKE_MEM_UNDEFINED(ptr, arena->slab_size);
+		return ptr;
+	}
+	if (used <= arena->reserved) {
 		ptr = arena->arena + used - arena->slab_size;
+		if (slab_arena_commit(ptr, arena->slab_size) != 0) {
+			/*
+			 * Other threads may have already taken the
+			 * following slabs, so the slab can't be given
+			 * back. It is lost, but takes no memory.
+			 */
+			pm_atomic_fetch_add(&arena->lost, arena->slab_size);
+			quota_release(arena->quota, arena->slab_size);
+			return NULL;
+		}
+		slab_arena_stat_add(&arena->stats.prealloc_hits, 1);
+		if (arena->prealloc_is_huge)
+			slab_arena_stat_add(&arena->stats.hugepage_slabs, 1);
 		VALGRIND_MAKE_MEM_UNDEFINED(ptr, arena->slab_size);
 		return ptr;
 	}
 
-	ptr = mmap_checked(arena->slab_size, arena->slab_size,
-			   arena->flags);
+	bool is_huge;
+	/* A file backed arena can't grow beyond the file. */
+	ptr = arena->header == NULL ?
+	      slab_arena_mmap(arena, arena->slab_size, &is_huge) : NULL;
 	if (!ptr) {
 		__sync_sub_and_fetch(&arena->used, arena->slab_size);
 		quota_release(arena->quota, arena->slab_size);
+		return NULL;
 	}
-
-	madvise_checked(ptr, arena->slab_size, arena->flags);
+	if (is_huge)
+		slab_arena_stat_add(&arena->stats.hugepage_slabs, 1);
 
 	VALGRIND_MAKE_MEM_UNDEFINED(ptr, arena->slab_size);
 	return ptr;
@@ -272,9 +933,444 @@ slab_unmap(struct slab_arena *arena, void *ptr)
 	if (ptr == NULL)
 		return;
 
+	struct slab_cached *cached = (struct slab_cached *)ptr;
+	cached->unmap_time = slab_arena_clock();
+	cached->is_purged = false;
+	slab_arena_dontfork(arena, ptr);
+	/* Count the slab first, so a concurrent pop can't wrap it. */
+	slab_arena_stat_add(&arena->stats.cached, arena->slab_size);
 	lf_lifo_push(&arena->cache, ptr);
 	VALGRIND_MAKE_MEM_NOACCESS(ptr, arena->slab_size);
-	VALGRIND_MAKE_MEM_DEFINED(lf_lifo(ptr), sizeof(struct lf_lifo));
+	VALGRIND_MAKE_MEM_DEFINED(cached, sizeof(*cached));
+}
+
+size_t
+slab_map_batch(struct slab_arena *arena, void **slabs, size_t count)
+{
+	size_t n = 0;
+	do {
+		n += lf_lifo_pop_n(&arena->cache, slabs + n, count - n);
+		n += lf_lifo_pop_n(&arena->scan, slabs + n, count - n);
+	} while (n < count && slab_depot_spill(arena));
+	size_t i;
+	for (i = 0; i < n; i++) {
+		slab_arena_dofork(arena, slabs[i]);
+		VALGRIND_MAKE_MEM_UNDEFINED(slabs[i], arena->slab_size);
+	}
+	if (n != 0) {
+		slab_arena_stat_add(&arena->stats.cache_hits, n);
+		slab_arena_stat_sub(&arena->stats.cached,
+				    n * arena->slab_size);
+	}
+	if (n == count)
+		return n;
+
+	size_t size = (count - n) * arena->slab_size;
+	if (quota_use(arena->quota, size) < 0) {
+		/* Fall back to as many slabs as the quota allows. */
+		void *ptr;
+		while (n < count && (ptr = slab_map(arena)) != NULL)
+			slabs[n++] = ptr;
+		return n;
+	}
+
+	/* Reuse the slabs reclaimed by slab_arena_shrink(). */
+	size_t released = lf_lifo_pop_n(&arena->released, slabs + n,
+					count - n);
+	for (; released != 0; released--, n++, size -= arena->slab_size) {
+		slab_arena_dofork(arena, slabs[n]);
+		VALGRIND_MAKE_MEM_UNDEFINED(slabs[n], arena->slab_size);
+	}
+	if (n == count)
+		return n;
+
+	/** Need to allocate new slabs. */
+	size_t used = pm_atomic_fetch_add(&arena->used, size);
+	for (; n < count && used + arena->slab_size <= arena->prealloc;
+	     n++, used += arena->slab_size, size -= arena->slab_size) {
+		slab_arena_stat_add(&arena->stats.prealloc_hits, 1);
+		slabs[n] = arena->arena + used;
+		if (arena->prealloc_is_huge)
+			slab_arena_stat_add(&arena->stats.hugepage_slabs, 1);
+		VALGRIND_MAKE_MEM_UNDEFINED(slabs[n], arena->slab_size);
+	}
+	if (n == count)
+		return n;
+
+	if (used < arena->reserved) {
+		/* Commit all slabs in the reserved area at once. */
+		size_t commit = MIN(size, arena->reserved - used);
+		char *ptr = (char *)arena->arena + used;
+		if (slab_arena_commit(ptr, commit) != 0) {
+			/* The slabs are lost, see slab_map(). */
+			pm_atomic_fetch_add(&arena->lost, commit);
+			quota_release(arena->quota, commit);
+			size -= commit;
+			used += commit;
+			/* Don't leak the tail of the batch. */
+			if (size != 0) {
+				__sync_sub_and_fetch(&arena->used, size);
+				quota_release(arena->quota, size);
+			}
+			return n;
+		}
+		if (arena->prealloc_is_huge) {
+			slab_arena_stat_add(&arena->stats.hugepage_slabs,
+					    commit / arena->slab_size);
+		}
+		slab_arena_stat_add(&arena->stats.prealloc_hits,
+				    commit / arena->slab_size);
+		VALGRIND_MAKE_MEM_UNDEFINED(ptr, commit);
+		for (; commit != 0; n++, ptr += arena->slab_size,
+		     used += arena->slab_size, size -= arena->slab_size,
+		     commit -= arena->slab_size)
+			slabs[n] = ptr;
+		if (n == count)
+			return n;
+	}
+
+	bool is_huge;
+	char *map = arena->header == NULL ?
+		    slab_arena_mmap(arena, size, &is_huge) : NULL;
+	if (map == NULL) {
+		__sync_sub_and_fetch(&arena->used, size);
+		quota_release(arena->quota, size);
+		return n;
+	}
+	if (is_huge)
+		slab_arena_stat_add(&arena->stats.hugepage_slabs, count - n);
+	VALGRIND_MAKE_MEM_UNDEFINED(map, size);
+	for (; n < count; n++, map += arena->slab_size)
+		slabs[n] = map;
+	return n;
+}
+
+void
+slab_unmap_batch(struct slab_arena *arena, void **slabs, size_t count)
+{
+	slab_arena_cache_batch(arena, slabs, count, slab_arena_clock());
+}
+
+void
+slab_thread_cache_create(struct slab_thread_cache *cache,
+			 struct slab_arena *arena)
+{
+	cache->arena = arena;
+	cache->loaded = &cache->magazines[0];
+	cache->prev = &cache->magazines[1];
+	cache->loaded->count = 0;
+	cache->prev->count = 0;
+}
+
+void
+slab_thread_cache_destroy(struct slab_thread_cache *cache)
+{
+	slab_unmap_batch(cache->arena, cache->loaded->slabs,
+			 cache->loaded->count);
+	slab_unmap_batch(cache->arena, cache->prev->slabs,
+			 cache->prev->count);
+	cache->loaded->count = 0;
+	cache->prev->count = 0;
+}
+
+static inline void
+slab_thread_cache_swap(struct slab_thread_cache *cache)
+{
+	struct slab_magazine *tmp = cache->loaded;
+	cache->loaded = cache->prev;
+	cache->prev = tmp;
+}
+
+void *
+slab_thread_cache_map(struct slab_thread_cache *cache)
+{
+	/* The previous magazine is always either full or empty. */
+	if (cache->loaded->count == 0) {
+		if (cache->prev->count != 0)
+			slab_thread_cache_swap(cache);
+		else if (!slab_depot_get(cache->arena, cache->loaded))
+			return slab_map(cache->arena);
+	}
+	struct slab_magazine *loaded = cache->loaded;
+	return loaded->slabs[--loaded->count];
+}
+
+void
+slab_thread_cache_unmap(struct slab_thread_cache *cache, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	if (cache->loaded->count == SLAB_MAGAZINE_SIZE) {
+		if (cache->prev->count != 0)
+			slab_depot_put(cache->arena, cache->prev);
+		slab_thread_cache_swap(cache);
+	}
+	struct slab_magazine *loaded = cache->loaded;
+	loaded->slabs[loaded->count++] = ptr;
+}
+
+void
+slab_arena_set_purge(struct slab_arena *arena, double delay,
+		     size_t watermark)
+{
+	arena->purge_delay = delay;
+	arena->purge_watermark = watermark;
+}
+
+/**
+ * Return memory of a cached slab except its header to the OS.
+ * Returns the number of bytes purged.
+ */
+static size_t
+slab_purge(struct slab_arena *arena, struct slab_cached *cached)
+{
+	size_t offset = slab_header_size(arena);
+	if (offset >= arena->slab_size)
+		return 0;
+	size_t size = arena->slab_size - offset;
+	int advice = MADV_DONTNEED;
+#ifdef MADV_REMOVE
+	/* Shared memory pages are only freed with MADV_REMOVE. */
+	if (IS_SLAB_ARENA_FLAG(arena->flags, SLAB_ARENA_SHARED))
+		advice = MADV_REMOVE;
+#endif
+	if (madvise((char *)cached + offset, size, advice) != 0)
+		return 0;
+	cached->is_purged = true;
+	return size;
+}
+
+/**
+ * Put the slabs moved to arena->scan back to the cache. They are
+ * moved there most recently cached first, so the cache gets back
+ * the original order.
+ */
+static void
+slab_arena_unscan(struct slab_arena *arena)
+{
+	void *ptr;
+	while ((ptr = lf_lifo_pop(&arena->scan)) != NULL)
+		lf_lifo_push(&arena->cache, ptr);
+}
+
+size_t
+slab_arena_trim(struct slab_arena *arena)
+{
+	/* Idle magazines of the depot are purged too. */
+	slab_arena_drain_depot(arena);
+	double now = slab_arena_clock();
+	/*
+	 * Move cached slabs, most recently cached first, to the
+	 * scan list one by one, purging idle ones on the way, so
+	 * that the cache is never detached as a whole. Slabs
+	 * cached after the walk has started are not counted.
+	 */
+	size_t count = pm_atomic_load_explicit(&arena->stats.cached,
+					       pm_memory_order_relaxed) /
+		       arena->slab_size;
+	size_t kept = 0;
+	size_t purged = 0;
+	struct slab_cached *cached;
+	for (; count > 0 && (cached = lf_lifo_pop(&arena->cache)) != NULL;
+	     count--) {
+		if (kept < arena->purge_watermark) {
+			kept += arena->slab_size;
+		} else if (!cached->is_purged &&
+			   now - cached->unmap_time >= arena->purge_delay) {
+			purged += slab_purge(arena, cached);
+		}
+		lf_lifo_push(&arena->scan, cached);
+	}
+	slab_arena_unscan(arena);
+	slab_arena_stat_add(&arena->stats.purged, purged);
+	return purged;
+}
+
+void
+slab_arena_add_shrinker(struct slab_arena *arena,
+			struct slab_arena_shrinker *shrinker)
+{
+	rlist_add_tail_entry(&arena->shrinkers, shrinker, in_arena);
+}
+
+void
+slab_arena_remove_shrinker(struct slab_arena_shrinker *shrinker)
+{
+	rlist_del_entry(shrinker, in_arena);
+}
+
+/** Give the memory of a cached slab back to the quota. */
+static void
+slab_reclaim(struct slab_arena *arena, struct slab_cached *cached)
+{
+	/*
+	 * The slab is not unmapped: a thread popping the cache
+	 * concurrently may still read its link. Its memory except
+	 * the header is returned to the operating system.
+	 */
+	if (!cached->is_purged) {
+		slab_arena_stat_add(&arena->stats.purged,
+				    slab_purge(arena, cached));
+	}
+	lf_lifo_push(&arena->released, cached);
+	slab_arena_stat_sub(&arena->stats.cached, arena->slab_size);
+	quota_release(arena->quota, arena->slab_size);
+}
+
+size_t
+slab_arena_shrink(struct slab_arena *arena, size_t total)
+{
+	struct slab_arena_shrinker *shrinker;
+	rlist_foreach_entry(shrinker, &arena->shrinkers, in_arena) {
+		if (quota_used(arena->quota) <= total)
+			break;
+		shrinker->shrink(shrinker);
+	}
+	slab_arena_drain_depot(arena);
+	if (arena->header == NULL && quota_used(arena->quota) > total) {
+		/*
+		 * Move cached slabs to the scan list one by one, so
+		 * that the least recently cached ones are on top of
+		 * it and are reclaimed first. The rest are put back
+		 * in the original order.
+		 */
+		size_t count = pm_atomic_load_explicit(
+			&arena->stats.cached, pm_memory_order_relaxed) /
+			arena->slab_size;
+		struct slab_cached *cached;
+		for (; count > 0 &&
+		     (cached = lf_lifo_pop(&arena->cache)) != NULL; count--)
+			lf_lifo_push(&arena->scan, cached);
+		while ((cached = lf_lifo_pop(&arena->scan)) != NULL) {
+			if (quota_used(arena->quota) > total)
+				slab_reclaim(arena, cached);
+			else
+				lf_lifo_push(&arena->cache, cached);
+		}
+	}
+	while (quota_set(arena->quota, total) < 0) {
+		size_t used = quota_used(arena->quota);
+		if (used > total)
+			return used - total;
+	}
+	return 0;
+}
+
+static void *
+slab_arena_purger_f(void *arg)
+{
+	struct slab_arena *arena = (struct slab_arena *)arg;
+	struct slab_arena_purger *purger = arena->purger;
+	pthread_mutex_lock(&purger->mutex);
+	while (!purger->is_stopped) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		double deadline = ts.tv_sec + ts.tv_nsec / 1e9 +
+				  purger->period;
+		ts.tv_sec = (time_t)deadline;
+		ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&purger->cond, &purger->mutex, &ts);
+		if (purger->is_stopped)
+			break;
+		pthread_mutex_unlock(&purger->mutex);
+		slab_arena_trim(arena);
+		pthread_mutex_lock(&purger->mutex);
+	}
+	pthread_mutex_unlock(&purger->mutex);
+	return NULL;
+}
+
+int
+slab_arena_start_purge_thread(struct slab_arena *arena, double period)
+{
+	assert(arena->purger == NULL);
+	struct slab_arena_purger *purger = malloc(sizeof(*purger));
+	if (purger == NULL)
+		return -1;
+	purger->period = period;
+	purger->is_stopped = false;
+	pthread_mutex_init(&purger->mutex, NULL);
+	pthread_cond_init(&purger->cond, NULL);
+	arena->purger = purger;
+	int rc = pthread_create(&purger->thread, NULL, slab_arena_purger_f,
+				arena);
+	if (rc != 0) {
+		arena->purger = NULL;
+		pthread_cond_destroy(&purger->cond);
+		pthread_mutex_destroy(&purger->mutex);
+		free(purger);
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+void
+slab_arena_stop_purge_thread(struct slab_arena *arena)
+{
+	struct slab_arena_purger *purger = arena->purger;
+	if (purger == NULL)
+		return;
+	pthread_mutex_lock(&purger->mutex);
+	purger->is_stopped = true;
+	pthread_cond_signal(&purger->cond);
+	pthread_mutex_unlock(&purger->mutex);
+	pthread_join(purger->thread, NULL);
+	pthread_cond_destroy(&purger->cond);
+	pthread_mutex_destroy(&purger->mutex);
+	free(purger);
+	arena->purger = NULL;
+}
+
+int
+slab_arena_bind_node(struct slab_arena *arena, int node)
+{
+#ifndef TARANTOOL_SMALL_HAVE_MBIND
+	(void)arena;
+	(void)node;
+	return -1;
+#else
+	if (node < 0 || node >= SLAB_ARENA_NODE_MAX)
+		return -1;
+	if (arena->arena != NULL &&
+	    mbind_checked(arena->arena, arena->reserved, node,
+			  SMALL_MPOL_MF_MOVE) != 0)
+		return -1;
+	arena->node = node;
+	return 0;
+#endif
+}
+
+void
+slab_arena_set_root(struct slab_arena *arena, void *root)
+{
+	assert(arena->header != NULL);
+	arena->header->root = root;
+}
+
+void *
+slab_arena_root(struct slab_arena *arena)
+{
+	assert(arena->header != NULL);
+	return arena->header->root;
+}
+
+void
+slab_arena_stats(struct slab_arena *arena, struct slab_arena_stats *stats)
+{
+#define STAT_LOAD(name) \
+	stats->name = pm_atomic_load_explicit(&arena->stats.name, \
+					      pm_memory_order_relaxed)
+	STAT_LOAD(cache_hits);
+	STAT_LOAD(prealloc_hits);
+	STAT_LOAD(mmap_calls);
+	STAT_LOAD(misaligned_retries);
+	STAT_LOAD(quota_failures);
+	STAT_LOAD(cached);
+	STAT_LOAD(purged);
+	STAT_LOAD(hugepage_slabs);
+	STAT_LOAD(fork_advise_failures);
+#undef STAT_LOAD
 }
 
 void
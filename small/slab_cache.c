@@ -42,6 +42,9 @@
 
 const uint32_t slab_magic = 0xeec0ffee;
 
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 #if !defined(MAP_ANONYMOUS)
 /*
  * MAP_ANON is deprecated, MAP_ANONYMOUS should be used instead.
@@ -121,48 +124,240 @@ slab_create(struct slab *slab, uint8_t order, size_t size)
 	slab->magic = slab_magic;
 	slab->order = order;
 	slab->in_use = 0;
+	slab->is_dontfork = false;
 	slab->size = size;
 }
 
-static inline struct slab *
-slab_buddy(struct slab_cache *cache, struct slab *slab)
+/**
+ * Buddy system metadata of an arena slab which is split into
+ * smaller slabs. It is stored out of line, in a meta slab, so
+ * that both halves of a split arena slab stay usable, and that
+ * finding, splitting and merging free slabs only touches this
+ * dense metadata and never the memory of the free slabs, which
+ * may be cold or even purged.
+ *
+ * A meta slab is a small slab of the cache keeping the metadata
+ * of many arena slabs. If there is no room for the metadata and
+ * no free slab to make a meta slab of, the meta slab is carved
+ * from the upper half of the arena slab being split. Such an
+ * arena slab is given back once it only keeps its own metadata.
+ *
+ * An arena slab which is not split (free or used as a whole) has
+ * no metadata: it is described by its own struct slab header.
+ */
+struct slab_chunk {
+	/**
+	 * Links in cache->orders[o].slabs, for each order o
+	 * the chunk has free slabs of. Must be the first member,
+	 * see slab_chunk_from_link(). The first one links a free
+	 * chunk in slab_meta::free.
+	 */
+	struct rlist in_order[ORDER_MAX];
+	/** Link in cache->chunk_tree. */
+	rb_node(struct slab_chunk) in_tree;
+	/** The split arena slab. */
+	char *base;
+	/** The number of free slabs of each order. */
+	uint32_t free_count[ORDER_MAX];
+	/** The number of used slabs. */
+	uint32_t used;
+	/**
+	 * A bit per slab of each order below order_max, set if
+	 * the slab is free and not split. The row of order o
+	 * starts at bit 2^(order_max - o) - 2.
+	 */
+	uint64_t bitmap[];
+};
+
+/**
+ * A slab of cache->meta_order which keeps struct slab_chunk
+ * objects of the cache, placed after this header. The slab is
+ * accounted in the total but not the used stats of its order.
+ */
+struct slab_meta {
+	/** slab.next_in_list is the link in cache->meta. */
+	struct slab slab;
+	/** Freed chunks, see slab_chunk::in_order. */
+	struct rlist free;
+	/** The number of chunks in use. */
+	uint32_t used;
+	/** The number of chunks ever taken, the rest are untouched. */
+	uint32_t count;
+};
+
+/** The number of chunks a meta slab keeps at least, if possible. */
+enum { SLAB_META_CHUNKS_MIN = 8 };
+
+static inline size_t
+slab_chunk_sizeof(uint8_t order_max)
 {
-	assert(slab->order <= cache->order_max);
+	size_t bits = ((size_t) 2 << order_max) - 2;
+	return small_align(sizeof(struct slab_chunk) +
+			   (bits + 63) / 64 * sizeof(uint64_t), 64);
+}
 
-	if (slab->order == cache->order_max)
-		return NULL;
-	/* The buddy address has its respective bit negated. */
-	return (void *)((intptr_t) slab ^ slab_order_size(cache, slab->order));
+/** The first chunk in a meta slab. */
+static inline struct slab_chunk *
+slab_meta_chunks(struct slab_meta *meta)
+{
+	return (struct slab_chunk *)
+		((char *) meta + small_align(sizeof(*meta), 64));
 }
 
-static inline struct slab *
-slab_split(struct slab_cache *cache, struct slab *slab)
+/** The number of chunks a meta slab can keep. */
+static inline uint32_t
+slab_meta_capacity(struct slab_cache *cache)
 {
-	assert(slab->order > 0);
+	return (slab_order_size(cache, cache->meta_order) -
+		small_align(sizeof(struct slab_meta), 64)) /
+	       slab_chunk_sizeof(cache->order_max);
+}
 
-	uint8_t new_order = slab->order - 1;
-	size_t new_size = slab_order_size(cache, new_order);
+/** The meta slab keeping a chunk. */
+static inline struct slab_meta *
+slab_chunk_meta(struct slab_cache *cache, struct slab_chunk *chunk)
+{
+	uintptr_t size = slab_order_size(cache, cache->meta_order);
+	return (struct slab_meta *) ((uintptr_t) chunk & ~(size - 1));
+}
 
-	slab_create(slab, new_order, new_size);
+static inline int
+slab_chunk_cmp(const struct slab_chunk *a, const struct slab_chunk *b)
+{
+	return a->base < b->base ? -1 : a->base > b->base;
+}
 
-	struct slab *buddy = slab_buddy(cache, slab);
-	VALGRIND_MAKE_MEM_UNDEFINED(buddy, sizeof(*buddy));
-	slab_create(buddy, new_order, new_size);
-	slab_list_add(&cache->orders[buddy->order], buddy, next_in_list);
+static inline int
+slab_chunk_cmp_key(const char *base, const struct slab_chunk *chunk)
+{
+	return base < chunk->base ? -1 : base > chunk->base;
+}
 
-	return slab;
+rb_gen_ext_key(static inline, slab_chunk_tree_, slab_chunk_tree_t,
+	       struct slab_chunk, in_tree, slab_chunk_cmp, const char *,
+	       slab_chunk_cmp_key)
+
+/** The metadata of the arena slab containing the given address. */
+static inline struct slab_chunk *
+slab_chunk(struct slab_cache *cache, void *ptr)
+{
+	uintptr_t slab_size = cache->arena->slab_size;
+	uintptr_t base = (uintptr_t) ptr & ~(slab_size - 1);
+	struct slab_chunk *chunk =
+		slab_chunk_tree_search(&cache->chunk_tree, (char *) base);
+	assert(chunk != NULL);
+	return chunk;
+}
+
+static inline struct slab_chunk *
+slab_chunk_from_link(struct rlist *link, uint8_t order)
+{
+	return (struct slab_chunk *) (link - order);
+}
+
+/** Index of an ordered slab among the slabs of its order. */
+static inline size_t
+slab_index(struct slab_cache *cache, struct slab *slab)
+{
+	uintptr_t offset = (uintptr_t) slab & (cache->arena->slab_size - 1);
+	return offset >> (cache->order0_size_lb + slab->order);
+}
+
+static inline size_t
+slab_chunk_bit(struct slab_cache *cache, uint8_t order, size_t i)
+{
+	return ((size_t) 1 << (cache->order_max - order)) - 2 + i;
+}
+
+static inline bool
+slab_chunk_is_free(struct slab_cache *cache, struct slab_chunk *chunk,
+		   uint8_t order, size_t i)
+{
+	size_t bit = slab_chunk_bit(cache, order, i);
+	return (chunk->bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void
+slab_chunk_add_free(struct slab_cache *cache, struct slab_chunk *chunk,
+		    uint8_t order, size_t i)
+{
+	assert(!slab_chunk_is_free(cache, chunk, order, i));
+	size_t bit = slab_chunk_bit(cache, order, i);
+	chunk->bitmap[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	if (chunk->free_count[order]++ == 0)
+		rlist_add(&cache->orders[order].slabs, &chunk->in_order[order]);
+	cache->orders[order].stats.total += slab_order_size(cache, order);
 }
 
-static inline struct slab *
-slab_merge(struct slab_cache *cache, struct slab *slab, struct slab *buddy)
+static inline void
+slab_chunk_del_free(struct slab_cache *cache, struct slab_chunk *chunk,
+		    uint8_t order, size_t i)
+{
+	assert(slab_chunk_is_free(cache, chunk, order, i));
+	size_t bit = slab_chunk_bit(cache, order, i);
+	chunk->bitmap[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+	if (--chunk->free_count[order] == 0)
+		rlist_del(&chunk->in_order[order]);
+	cache->orders[order].stats.total -= slab_order_size(cache, order);
+}
+
+/** Find the first free slab of the given order in a chunk. */
+static inline size_t
+slab_chunk_find_free(struct slab_cache *cache, struct slab_chunk *chunk,
+		     uint8_t order)
+{
+	assert(chunk->free_count[order] > 0);
+	size_t start = slab_chunk_bit(cache, order, 0);
+	size_t bit = start;
+	/*
+	 * The row has a set bit, so the first set bit past
+	 * the row start can't belong to the next row.
+	 */
+	uint64_t word = chunk->bitmap[bit / 64] >> (bit % 64);
+	while (word == 0) {
+		bit = (bit / 64 + 1) * 64;
+		word = chunk->bitmap[bit / 64];
+	}
+	return bit + __builtin_ctzll(word) - start;
+}
+
+/**
+ * Split a slab of the given order down to the requested order,
+ * marking the upper halves free. Returns the index of the lowest
+ * slab of the requested order, which is left to the caller.
+ */
+static inline size_t
+slab_chunk_split(struct slab_cache *cache, struct slab_chunk *chunk,
+		 uint8_t order, size_t i, uint8_t new_order)
+{
+	while (order > new_order) {
+		cache->counters[order].splits++;
+		order--;
+		i <<= 1;
+		slab_chunk_add_free(cache, chunk, order, i + 1);
+	}
+	return i;
+}
+
+/**
+ * The cache may be used by its owner thread concurrently, so
+ * only request a shrink, see slab_cache_drain_remote().
+ */
+static size_t
+slab_cache_shrink_f(struct slab_arena_shrinker *shrinker)
 {
-	assert(slab_buddy(cache, slab) == buddy);
-	struct slab *merged = slab > buddy ? buddy : slab;
-	/** Remove the buddy from the free list. */
-	slab_list_del(&cache->orders[buddy->order], buddy, next_in_list);
-	merged->order++;
-	merged->size = slab_order_size(cache, merged->order);
-	return merged;
+	struct slab_cache *cache = (struct slab_cache *)
+		((char *)shrinker - offsetof(struct slab_cache, shrinker));
+	pm_atomic_store(&cache->shrink_requested, true);
+	return 0;
+}
+
+/** True if other threads left work for the owner thread. */
+static inline bool
+slab_cache_has_remote(struct slab_cache *cache)
+{
+	return pm_atomic_load(&cache->remote_free) != NULL ||
+	       pm_atomic_load(&cache->shrink_requested);
 }
 
 void
@@ -182,20 +377,64 @@ slab_cache_create(struct slab_cache *cache, struct slab_arena *arena)
 
 	cache->order0_size = arena->slab_size >> cache->order_max;
 	cache->order0_size_lb = small_lb(cache->order0_size);
+	/* Meta slabs are the smallest ones keeping a few chunks. */
+	cache->meta_order = 0;
+	while (cache->meta_order + 1 < cache->order_max &&
+	       slab_meta_capacity(cache) < SLAB_META_CHUNKS_MIN)
+		cache->meta_order++;
+	assert(cache->order_max == 0 || slab_meta_capacity(cache) > 0);
 
 	slab_list_create(&cache->allocated);
 	uint8_t i;
 	for (i = 0; i <= cache->order_max; i++)
 		slab_list_create(&cache->orders[i]);
+	cache->refill_batch = 1;
+	cache->refill_max = 1;
+	slab_list_create(&cache->large_free);
+	cache->retention.min_retained = 0;
+	cache->retention.max_retained = arena->slab_size;
+	cache->retention.decay = 0;
+	cache->retained = cache->retained_low = 0;
+	cache->retained_tick = 0;
+	cache->chunks = 0;
+	slab_chunk_tree_new(&cache->chunk_tree);
+	rlist_create(&cache->meta);
+	cache->meta_slabs = 0;
+	memset(cache->counters, 0, sizeof(cache->counters));
+	rlist_create(&cache->shrinker.in_arena);
+	cache->shrinker.shrink = slab_cache_shrink_f;
+	cache->remote_free = NULL;
+	cache->shrink_requested = false;
 	slab_cache_set_thread(cache);
 
 	VALGRIND_CREATE_MEMPOOL_EXT(cache, 0, 0, VALGRIND_MEMPOOL_METAPOOL |
 				    VALGRIND_MEMPOOL_AUTO_FREE);
 }
 
+void
+slab_cache_reattach(struct slab_cache *cache, struct slab_arena *arena)
+{
+	assert(arena->header != NULL);
+	assert(arena->slab_size == cache->order0_size << cache->order_max);
+	cache->arena = arena;
+	/* The link points to the previous process memory. */
+	rlist_create(&cache->shrinker.in_arena);
+	cache->shrinker.shrink = slab_cache_shrink_f;
+	/* Slabs queued by threads of the previous process are lost. */
+	cache->remote_free = NULL;
+	cache->shrink_requested = false;
+	/* The clock of the previous process is meaningless. */
+	cache->retained_tick = quota_clock();
+	slab_cache_set_thread(cache);
+	VALGRIND_CREATE_MEMPOOL_EXT(cache, 0, 0, VALGRIND_MEMPOOL_METAPOOL |
+				    VALGRIND_MEMPOOL_AUTO_FREE);
+}
+
 void
 slab_cache_destroy(struct slab_cache *cache)
 {
+	slab_arena_remove_shrinker(&cache->shrinker);
+	slab_cache_drain_remote(cache);
 	struct rlist *slabs = &cache->allocated.slabs;
 	/*
 	 * cache->allocated contains huge allocations and
@@ -207,8 +446,9 @@ slab_cache_destroy(struct slab_cache *cache)
 		if (slab->order == cache->order_max + 1) {
 			size_t slab_size = slab->size;
 			quota_release(cache->arena->quota, slab_size);
-			VALGRIND_MEMPOOL_FREE(cache, slab_data(slab));
-			free(slab);
+			if (!slab_is_free(slab))
+				VALGRIND_MEMPOOL_FREE(cache, slab_data(slab));
+			munmap(slab, slab_size);
 		} else {
 			slab_unmap(cache->arena, slab);
 		}
@@ -218,69 +458,560 @@ slab_cache_destroy(struct slab_cache *cache)
 	VALGRIND_DESTROY_MEMPOOL(cache);
 }
 
+/** Unmap a free large slab and give its quota back. */
+static void
+slab_large_unmap(struct slab_cache *cache, struct slab *slab)
+{
+	assert(slab_is_free(slab));
+	size_t size = slab->size;
+	slab_list_del(&cache->large_free, slab, next_in_list);
+	slab_list_del(&cache->allocated, slab, next_in_cache);
+	quota_release(cache->arena->quota, size);
+	munmap(slab, size);
+}
+
+/** Unmap all the free large slabs the cache retains. */
+static size_t
+slab_cache_release_large(struct slab_cache *cache)
+{
+	size_t size = cache->large_free.stats.total;
+	while (!rlist_empty(&cache->large_free.slabs)) {
+		slab_large_unmap(cache, rlist_first_entry(
+			&cache->large_free.slabs, struct slab, next_in_list));
+	}
+	return size;
+}
+
+/**
+ * Map new arena slabs into the free list of the largest order.
+ * The cache which keeps running out of free slabs gets several
+ * slabs at once, unless the quota is about to run out.
+ */
+static int
+slab_cache_refill(struct slab_cache *cache)
+{
+	struct slab_arena *arena = cache->arena;
+	size_t batch = cache->refill_batch;
+	if (batch > 1) {
+		size_t total, used;
+		quota_get_total_and_used(arena->quota, &total, &used);
+		size_t headroom = total > used ? total - used : 0;
+		batch = MAX(MIN(batch, headroom / arena->slab_size / 2), 1);
+	}
+	void *slabs[SLAB_CACHE_REFILL_MAX];
+	size_t count = slab_map_batch(arena, slabs, batch);
+	if (count == 0)
+		return -1;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		struct slab *slab = (struct slab *)slabs[i];
+		slab_create(slab, cache->order_max, arena->slab_size);
+		slab_poison(slab);
+		slab_list_add(&cache->allocated, slab, next_in_cache);
+		slab_list_add(&cache->orders[cache->order_max], slab,
+			      next_in_list);
+	}
+	cache->retained += count;
+	if (cache->refill_batch < cache->refill_max)
+		cache->refill_batch = MIN(cache->refill_batch * 2,
+					  cache->refill_max);
+	return 0;
+}
+
+/**
+ * Return the given number of the least recently freed slabs
+ * of the largest order to the arena.
+ */
+static void
+slab_cache_release(struct slab_cache *cache, uint32_t count)
+{
+	assert(count <= cache->retained);
+	struct slab_list *list = &cache->orders[cache->order_max];
+	void *slabs[SLAB_CACHE_REFILL_MAX];
+	size_t batch = 0;
+	cache->retained -= count;
+	if (cache->retained_low > cache->retained)
+		cache->retained_low = cache->retained;
+	while (count-- > 0) {
+		struct slab *slab = rlist_last_entry(&list->slabs, struct slab,
+						     next_in_list);
+		slab_list_del(list, slab, next_in_list);
+		slab_list_del(&cache->allocated, slab, next_in_cache);
+		slabs[batch++] = slab;
+		if (batch == SLAB_CACHE_REFILL_MAX) {
+			slab_unmap_batch(cache->arena, slabs, batch);
+			batch = 0;
+		}
+	}
+	slab_unmap_batch(cache->arena, slabs, batch);
+	cache->refill_batch = 1;
+}
+
+/**
+ * Return @a count free slabs of the largest order to the arena
+ * along with the slabs which stayed free for the whole last decay
+ * period, i.e. the lowest number of free slabs seen during the
+ * period. Never goes below min_retained.
+ */
+static void
+slab_cache_decay(struct slab_cache *cache, uint32_t count)
+{
+	const struct slab_cache_retention *retention = &cache->retention;
+	if (cache->retained <= retention->min_retained)
+		return;
+	uint32_t spare = cache->retained - retention->min_retained;
+	count = MIN(spare, count);
+	bool is_decayed = false;
+	if (retention->decay > 0) {
+		double now = quota_clock();
+		if (now - cache->retained_tick >= retention->decay) {
+			count = MAX(count, MIN(spare, cache->retained_low));
+			cache->retained_tick = now;
+			is_decayed = true;
+		}
+	}
+	if (count > 0)
+		slab_cache_release(cache, count);
+	if (is_decayed)
+		cache->retained_low = cache->retained;
+}
+
+/**
+ * Apply the retention policy to the free slabs of the largest
+ * order: return the slabs over max_retained bytes and the ones
+ * which decayed.
+ */
+static void
+slab_cache_trim(struct slab_cache *cache)
+{
+	size_t max = cache->retention.max_retained / cache->arena->slab_size;
+	slab_cache_decay(cache, cache->retained > max ?
+				cache->retained - max : 0);
+}
+
+/**
+ * Take a free slab of the largest order, mapping new arena
+ * slabs if there is none. The slab stays accounted in the
+ * stats of the largest order.
+ */
+static struct slab *
+slab_cache_take_max(struct slab_cache *cache)
+{
+	struct slab_list *list = &cache->orders[cache->order_max];
+	/* Retained large slabs are charged to the quota too. */
+	if (rlist_empty(&list->slabs) && slab_cache_refill(cache) != 0 &&
+	    (slab_cache_release_large(cache) == 0 ||
+	     slab_cache_refill(cache) != 0))
+		return NULL;
+	struct slab *slab = rlist_shift_entry(&list->slabs, struct slab,
+					      next_in_list);
+	if (--cache->retained < cache->retained_low)
+		cache->retained_low = cache->retained;
+	if (slab->is_dontfork) {
+		slab_arena_dofork(cache->arena, slab);
+		slab->is_dontfork = false;
+	}
+	return slab;
+}
+
+/**
+ * Put a free slab of the largest order to the cache, which keeps
+ * the most recently freed slabs and returns the rest to the arena
+ * according to the retention policy.
+ */
+static void
+slab_cache_put_max(struct slab_cache *cache, struct slab *slab)
+{
+	struct slab_list *list = &cache->orders[cache->order_max];
+	rlist_add_entry(&list->slabs, slab, next_in_list);
+	cache->retained++;
+	slab_cache_trim(cache);
+	if (cache->retained > 0 &&
+	    rlist_first_entry(&list->slabs, struct slab,
+			      next_in_list) == slab &&
+	    IS_SLAB_ARENA_FLAG(cache->arena->flags, SLAB_ARENA_DONTFORK)) {
+		slab_arena_dontfork(cache->arena, slab);
+		slab->is_dontfork = true;
+	}
+}
+
+static void
+slab_cache_merge(struct slab_cache *cache, struct slab *slab);
+
+/**
+ * Give a meta slab back to the buddy system. The meta slab keeps
+ * either no chunks or only the chunk of the arena slab it is part
+ * of, which is then given back along with it.
+ */
+static void
+slab_meta_release(struct slab_cache *cache, struct slab_meta *meta)
+{
+	struct slab *slab = &meta->slab;
+	rlist_del_entry(slab, next_in_list);
+	cache->meta_slabs--;
+	slab->in_use = 0;
+	/* The chunk of the arena slab is needed to merge it. */
+	if (meta->used == 0)
+		slab_poison(slab);
+	slab_cache_merge(cache, slab);
+}
+
+/** True if the chunk is kept in the arena slab it describes. */
+static inline bool
+slab_chunk_is_self_hosted(struct slab_cache *cache, struct slab_chunk *chunk)
+{
+	uintptr_t slab_size = cache->arena->slab_size;
+	return ((uintptr_t) chunk & ~(slab_size - 1)) ==
+	       (uintptr_t) chunk->base;
+}
+
+/**
+ * Give back an arena slab which only keeps its own metadata:
+ * the meta slab in its upper half is the only slab in use and
+ * keeps only the chunk of the arena slab.
+ */
+static void
+slab_chunk_release_host(struct slab_cache *cache, struct slab_chunk *chunk)
+{
+	struct slab_meta *meta = slab_chunk_meta(cache, chunk);
+	if (chunk->used == 1 && slab_chunk_is_self_hosted(cache, chunk) &&
+	    meta->used == 1)
+		slab_meta_release(cache, meta);
+}
+
+/**
+ * Turn a slab of meta_order which is not accounted in the stats
+ * into a meta slab with no chunks.
+ */
+static struct slab_meta *
+slab_meta_create(struct slab_cache *cache, struct slab *slab)
+{
+	struct slab_meta *meta = (struct slab_meta *) slab;
+	VALGRIND_MAKE_MEM_UNDEFINED(slab, sizeof(*slab));
+	slab_create(slab, cache->meta_order,
+		    slab_order_size(cache, cache->meta_order));
+	cache->orders[cache->meta_order].stats.total += slab->size;
+	VALGRIND_MAKE_MEM_UNDEFINED(slab_data(slab),
+				    sizeof(*meta) - slab_sizeof());
+	/* Neither free nor accounted as used. */
+	slab->in_use = cache->meta_order + 1;
+	rlist_create(&meta->free);
+	meta->used = 0;
+	meta->count = 0;
+	rlist_add_entry(&cache->meta, slab, next_in_list);
+	cache->meta_slabs++;
+	return meta;
+}
+
+/** Take a chunk from a meta slab with free room. */
+static struct slab_chunk *
+slab_meta_take(struct slab_cache *cache, struct slab_meta *meta)
+{
+	size_t size = slab_chunk_sizeof(cache->order_max);
+	struct slab_chunk *chunk;
+	if (!rlist_empty(&meta->free)) {
+		chunk = slab_chunk_from_link(rlist_shift(&meta->free), 0);
+	} else {
+		chunk = (struct slab_chunk *)
+			((char *) slab_meta_chunks(meta) + meta->count * size);
+		meta->count++;
+	}
+	if (++meta->used == slab_meta_capacity(cache))
+		rlist_move_tail_entry(&cache->meta, &meta->slab, next_in_list);
+	VALGRIND_MAKE_MEM_UNDEFINED(chunk, size);
+	memset(chunk, 0, size);
+	cache->chunks++;
+	return chunk;
+}
+
+/**
+ * Take a chunk for the metadata of an arena slab to split.
+ * Meta slabs with free chunks go first in cache->meta, a new
+ * one is made of a free slab if all are full. Returns NULL if
+ * there is no free slab of meta_order or larger to make it of.
+ */
+static struct slab_chunk *
+slab_chunk_alloc(struct slab_cache *cache)
+{
+	struct slab_meta *meta = NULL;
+	if (!rlist_empty(&cache->meta)) {
+		meta = rlist_first_entry(&cache->meta, struct slab_meta,
+					 slab.next_in_list);
+		if (meta->used == slab_meta_capacity(cache))
+			meta = NULL;
+	}
+	if (meta == NULL) {
+		uint8_t o;
+		for (o = cache->meta_order; o < cache->order_max; o++) {
+			if (!rlist_empty(&cache->orders[o].slabs))
+				break;
+		}
+		if (o == cache->order_max)
+			return NULL;
+		struct slab_chunk *host =
+			slab_chunk_from_link(cache->orders[o].slabs.next, o);
+		size_t i = slab_chunk_find_free(cache, host, o);
+		slab_chunk_del_free(cache, host, o, i);
+		i = slab_chunk_split(cache, host, o, i, cache->meta_order);
+		host->used++;
+		size_t size = slab_order_size(cache, cache->meta_order);
+		meta = slab_meta_create(cache, (struct slab *)
+					(host->base + i * size));
+	}
+	return slab_meta_take(cache, meta);
+}
+
+/**
+ * Give a chunk back to its meta slab. An empty meta slab is given
+ * back to the buddy system like any other free slab.
+ */
+static void
+slab_chunk_free(struct slab_cache *cache, struct slab_chunk *chunk)
+{
+	struct slab_meta *meta = slab_chunk_meta(cache, chunk);
+	assert(meta->used > 0);
+	rlist_add(&meta->free, &chunk->in_order[0]);
+	cache->chunks--;
+	rlist_move_entry(&cache->meta, &meta->slab, next_in_list);
+	if (--meta->used == 0) {
+		slab_meta_release(cache, meta);
+	} else if (meta->used == 1 &&
+		   ((uintptr_t) meta & (cache->arena->slab_size - 1)) ==
+		   cache->arena->slab_size / 2) {
+		/* The meta slab may keep only its own chunk now. */
+		slab_chunk_release_host(cache, slab_chunk(cache, meta));
+	}
+}
+
+/**
+ * Start splitting an arena slab: link its metadata and mark both
+ * halves free. The arena slab must not be accounted in the
+ * cache->orders stats.
+ */
+static void
+slab_chunk_create(struct slab_cache *cache, struct slab_chunk *chunk,
+		  struct slab *slab)
+{
+	assert(((uintptr_t) slab & (cache->arena->slab_size - 1)) == 0);
+	chunk->base = (char *) slab;
+	slab_chunk_tree_insert(&cache->chunk_tree, chunk);
+	cache->counters[cache->order_max].splits++;
+	slab_chunk_add_free(cache, chunk, cache->order_max - 1, 0);
+	slab_chunk_add_free(cache, chunk, cache->order_max - 1, 1);
+}
+
+/**
+ * Turn a chunk with no used slabs, merged back into a whole,
+ * into a free arena slab accounted in the stats of the largest
+ * order.
+ */
+static struct slab *
+slab_chunk_destroy(struct slab_cache *cache, struct slab_chunk *chunk)
+{
+	assert(chunk->used == 0);
+	struct slab *slab = (struct slab *) chunk->base;
+	slab_chunk_tree_remove(&cache->chunk_tree, chunk);
+	if (slab_chunk_is_self_hosted(cache, chunk)) {
+		/* The meta slab keeping it is already given back. */
+		cache->chunks--;
+	} else {
+		slab_chunk_free(cache, chunk);
+	}
+	/* Keeps slab->next_in_cache intact. */
+	slab_create(slab, cache->order_max, cache->arena->slab_size);
+	cache->orders[cache->order_max].stats.total += slab->size;
+	return slab;
+}
+
+/**
+ * Split a new arena slab into two free halves. If there is no
+ * room for its metadata, a meta slab is carved from its upper
+ * half, so the lower one stays whole.
+ */
+static int
+slab_cache_split(struct slab_cache *cache)
+{
+	struct slab_chunk *chunk = slab_chunk_alloc(cache);
+	struct slab *slab = slab_cache_take_max(cache);
+	if (slab == NULL) {
+		if (chunk != NULL)
+			slab_chunk_free(cache, chunk);
+		return -1;
+	}
+	/*
+	 * Do not "bill" the size of this slab to this
+	 * order, to prevent double accounting of the
+	 * same memory.
+	 */
+	cache->orders[cache->order_max].stats.total -= slab->size;
+	if (chunk != NULL) {
+		slab_chunk_create(cache, chunk, slab);
+		return 0;
+	}
+	struct slab_meta *meta = slab_meta_create(cache, (struct slab *)
+		((char *) slab + cache->arena->slab_size / 2));
+	chunk = slab_meta_take(cache, meta);
+	/* Free slabs have no headers, the meta slab is kept intact. */
+	slab_chunk_create(cache, chunk, slab);
+	slab_chunk_del_free(cache, chunk, cache->order_max - 1, 1);
+	slab_chunk_split(cache, chunk, cache->order_max - 1, 1,
+			 cache->meta_order);
+	chunk->used++;
+	return 0;
+}
+
 struct slab *
 slab_get_with_order(struct slab_cache *cache, uint8_t order)
 {
 	assert(order <= cache->order_max);
+	if (slab_cache_has_remote(cache))
+		slab_cache_drain_remote(cache);
 	struct slab *slab;
+	if (order == cache->order_max) {
+		if (cache->retained > 0)
+			cache->counters[order].hits++;
+		else
+			cache->counters[order].misses++;
+		slab = slab_cache_take_max(cache);
+		if (slab == NULL)
+			return NULL;
+		slab_set_used(cache, slab);
+		slab_assert(cache, slab);
+		slab_cache_decay(cache, 0);
+		return slab;
+	}
 	/* Search for the first available slab. If a slab
 	 * of a bigger size is found, it can be split.
 	 * If cache->order_max is reached and there are no
 	 * free slabs, allocate a new one on arena.
 	 */
-	struct slab_list *list= &cache->orders[order];
-
-	for ( ; rlist_empty(&list->slabs); list++) {
-		if (list == cache->orders + cache->order_max) {
-			slab = slab_map(cache->arena);
-			if (slab == NULL)
-				return NULL;
-			slab_create(slab, cache->order_max,
-				    cache->arena->slab_size);
-			slab_poison(slab);
-			slab_list_add(&cache->allocated, slab,
-				      next_in_cache);
-			slab_list_add(list, slab, next_in_list);
+	uint8_t o;
+	for (o = order; o < cache->order_max; o++) {
+		if (!rlist_empty(&cache->orders[o].slabs))
 			break;
-		}
 	}
-	slab = rlist_shift_entry(&list->slabs, struct slab, next_in_list);
-	if (slab->order != order) {
-		/*
-		 * Do not "bill" the size of this slab to this
-		 * order, to prevent double accounting of the
-		 * same memory.
-		 */
-		list->stats.total -= slab->size;
-		/* Get a slab of the right order. */
-		do {
-			slab = slab_split(cache, slab);
-		} while (slab->order != order);
-		/*
-		 * Count the slab in this order. The buddy is
-		 * already taken care of by slab_split.
-		 */
-		cache->orders[slab->order].stats.total += slab->size;
+	if (o < cache->order_max || cache->retained > 0)
+		cache->counters[order].hits++;
+	else
+		cache->counters[order].misses++;
+	if (o == cache->order_max) {
+		if (slab_cache_split(cache) != 0)
+			return NULL;
+		for (o = order; rlist_empty(&cache->orders[o].slabs); o++)
+			assert(o < cache->order_max - 1);
 	}
+	struct slab_chunk *chunk =
+		slab_chunk_from_link(cache->orders[o].slabs.next, o);
+	size_t i = slab_chunk_find_free(cache, chunk, o);
+	slab_chunk_del_free(cache, chunk, o, i);
+	/* Get a slab of the right order. */
+	i = slab_chunk_split(cache, chunk, o, i, order);
+	chunk->used++;
+
+	char *base = chunk->base;
+	slab = (struct slab *) (base + i * slab_order_size(cache, order));
+	/*
+	 * The header of the slab at the base of the arena slab
+	 * is never poisoned and has the cache->allocated link.
+	 */
+	if ((char *) slab != base)
+		VALGRIND_MAKE_MEM_UNDEFINED(slab, sizeof(*slab));
+	slab_create(slab, order, slab_order_size(cache, order));
+	cache->orders[order].stats.total += slab->size;
 	slab_set_used(cache, slab);
 	slab_assert(cache, slab);
+	slab_cache_decay(cache, 0);
 	return slab;
 }
 
-struct slab *
-slab_get_large(struct slab_cache *cache, size_t size)
+/** Page-granular size of a large slab for the given size. */
+static inline size_t
+slab_large_size(size_t size)
 {
-	size += slab_sizeof();
-	if (quota_use(cache->arena->quota, size) < 0)
-		return NULL;
-	struct slab *slab = (struct slab *) malloc(size);
-	if (slab == NULL) {
-		quota_release(cache->arena->quota, size);
+	return small_align(size + slab_sizeof(), small_getpagesize());
+}
+
+/**
+ * Take the smallest retained large slab which fits the size,
+ * unmapping its excess pages.
+ */
+static struct slab *
+slab_large_reuse(struct slab_cache *cache, size_t size)
+{
+	struct slab *slab, *best = NULL;
+	rlist_foreach_entry(slab, &cache->large_free.slabs, next_in_list) {
+		if (slab->size >= size &&
+		    (best == NULL || slab->size < best->size))
+			best = slab;
+	}
+	if (best == NULL)
 		return NULL;
+	slab_list_del(&cache->large_free, best, next_in_list);
+	if (best->size > size) {
+		size_t excess = best->size - size;
+		munmap((char *) best + size, excess);
+		quota_release(cache->arena->quota, excess);
+		cache->allocated.stats.total -= excess;
+		best->size = size;
 	}
+	return best;
+}
 
-	slab_create(slab, cache->order_max + 1, size);
-	slab_list_add(&cache->allocated, slab, next_in_cache);
+/**
+ * Resize a mapping, moving it if necessary. Returns the new
+ * address or NULL, in which case the mapping is intact.
+ */
+static void *
+slab_large_remap(void *ptr, size_t old_size, size_t size)
+{
+#if defined(MREMAP_MAYMOVE)
+	void *map = mremap(ptr, old_size, size, MREMAP_MAYMOVE);
+	return map == MAP_FAILED ? NULL : map;
+#else
+	if (size < old_size) {
+		munmap((char *) ptr + size, old_size - size);
+		return ptr;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	memcpy(map, ptr, old_size);
+	munmap(ptr, old_size);
+	return map;
+#endif
+}
+
+struct slab *
+slab_get_large(struct slab_cache *cache, size_t size)
+{
+	if (slab_cache_has_remote(cache))
+		slab_cache_drain_remote(cache);
+	size = slab_large_size(size);
+	struct slab *slab = slab_large_reuse(cache, size);
+	if (slab != NULL) {
+		cache->counters[cache->order_max + 1].hits++;
+	} else {
+		cache->counters[cache->order_max + 1].misses++;
+		struct quota *quota = cache->arena->quota;
+		/* Retained slabs are charged to the quota too. */
+		if (quota_use(quota, size) < 0 &&
+		    (slab_cache_release_large(cache) == 0 ||
+		     quota_use(quota, size) < 0))
+			return NULL;
+		slab = (struct slab *) mmap(NULL, size,
+					    PROT_READ | PROT_WRITE,
+					    MAP_PRIVATE | MAP_ANONYMOUS,
+					    -1, 0);
+		if (slab == MAP_FAILED) {
+			quota_release(quota, size);
+			return NULL;
+		}
+		slab_create(slab, cache->order_max + 1, size);
+		slab_list_add(&cache->allocated, slab, next_in_cache);
+	}
+	/* Not a boolean to have an extra assert. */
+	slab->in_use = 1 + slab->order;
 	cache->allocated.stats.used += size;
 	VALGRIND_MEMPOOL_ALLOC(cache, slab_data(slab),
 			       slab_capacity(slab));
@@ -292,18 +1023,24 @@ slab_put_large(struct slab_cache *cache, struct slab *slab)
 {
 	slab_assert(cache, slab);
 	assert(slab->order == cache->order_max + 1);
-	/*
-	 * Free a huge slab right away, we have no
-	 * further business to do with it.
-	 */
-	size_t slab_size = slab->size;
-	slab_list_del(&cache->allocated, slab, next_in_cache);
-	cache->allocated.stats.used -= slab_size;
-	quota_release(cache->arena->quota, slab_size);
+	assert(slab->in_use == slab->order + 1);
+	cache->allocated.stats.used -= slab->size;
+	slab->in_use = 0;
 	slab_poison(slab);
 	VALGRIND_MEMPOOL_FREE(cache, slab_data(slab));
-	free(slab);
-	return;
+	/*
+	 * Keep a few recently freed huge slabs mapped for reuse,
+	 * evicting the least recently freed one.
+	 */
+	slab_list_add(&cache->large_free, slab, next_in_list);
+	size_t count = 0;
+	struct slab *it;
+	rlist_foreach_entry(it, &cache->large_free.slabs, next_in_list)
+		count++;
+	if (count > SLAB_CACHE_LARGE_RETAIN_MAX) {
+		slab_large_unmap(cache, rlist_last_entry(
+			&cache->large_free.slabs, struct slab, next_in_list));
+	}
 }
 
 /**
@@ -326,6 +1063,200 @@ slab_get(struct slab_cache *cache, size_t size)
 	return slab;
 }
 
+/**
+ * Check that an ordered slab can grow to the given order in
+ * place, i.e. it is the lower half of each merged pair and
+ * all the buddies on the way are free and not split.
+ */
+static bool
+slab_can_grow(struct slab_cache *cache, struct slab *slab, uint8_t order)
+{
+	if (slab->order == cache->order_max)
+		return false;
+	struct slab_chunk *chunk = slab_chunk(cache, slab);
+	size_t i = slab_index(cache, slab);
+	uint8_t o;
+	for (o = slab->order; o < order; o++, i >>= 1) {
+		if ((i & 1) != 0 || !slab_chunk_is_free(cache, chunk, o, i + 1))
+			return false;
+	}
+	return true;
+}
+
+static struct slab *
+slab_realloc_large(struct slab_cache *cache, struct slab *slab, size_t size)
+{
+	struct quota *quota = cache->arena->quota;
+	size = slab_large_size(size);
+	size_t old_size = slab->size;
+	if (size == old_size)
+		return slab;
+	if (size > old_size && quota_use(quota, size - old_size) < 0)
+		return NULL;
+	slab_list_del(&cache->allocated, slab, next_in_cache);
+	/* Valgrind needs the old address after the remap. */
+	uintptr_t old_data = (uintptr_t) slab_data(slab);
+	(void) old_data;
+	struct slab *new_slab = (struct slab *)
+		slab_large_remap(slab, old_size, size);
+	if (new_slab == NULL) {
+		slab_list_add(&cache->allocated, slab, next_in_cache);
+		if (size > old_size)
+			quota_release(quota, size - old_size);
+		return NULL;
+	}
+	if (size < old_size)
+		quota_release(quota, old_size - size);
+	new_slab->size = size;
+	slab_list_add(&cache->allocated, new_slab, next_in_cache);
+	cache->allocated.stats.used += size;
+	cache->allocated.stats.used -= old_size;
+	VALGRIND_MEMPOOL_CHANGE(cache, old_data, slab_data(new_slab),
+				slab_capacity(new_slab));
+	return new_slab;
+}
+
+struct slab *
+slab_realloc(struct slab_cache *cache, struct slab *slab, size_t size)
+{
+	slab_assert(cache, slab);
+	uint8_t order = slab_order(cache, size + slab_sizeof());
+	if (slab->order == cache->order_max + 1) {
+		if (order != slab->order)
+			return NULL;
+		return slab_realloc_large(cache, slab, size);
+	}
+	assert(!slab_is_free(slab));
+	if (order == cache->order_max + 1)
+		return NULL;
+	if (order == slab->order)
+		return slab;
+	if (order > slab->order && !slab_can_grow(cache, slab, order))
+		return NULL;
+	struct slab_chunk *chunk;
+	if (slab->order == cache->order_max) {
+		/* Shrinking a whole arena slab splits it. */
+		chunk = slab_chunk_alloc(cache);
+		if (chunk == NULL)
+			return NULL;
+	} else {
+		chunk = slab_chunk(cache, slab);
+	}
+
+	size_t old_capacity = slab_capacity(slab);
+	size_t new_capacity = slab_order_size(cache, order) - slab_sizeof();
+	if (new_capacity < old_capacity) {
+		VALGRIND_MAKE_MEM_NOACCESS((char *) slab_data(slab) +
+					   new_capacity,
+					   old_capacity - new_capacity);
+	}
+	cache->allocated.stats.used -= slab->size;
+	cache->orders[slab->order].stats.used -= slab->size;
+	cache->orders[slab->order].stats.total -= slab->size;
+	if (slab->order == cache->order_max) {
+		/* Split the arena slab, the data stays at the base. */
+		slab_chunk_create(cache, chunk, slab);
+		slab_chunk_del_free(cache, chunk, cache->order_max - 1, 0);
+		slab_chunk_split(cache, chunk, cache->order_max - 1, 0, order);
+		chunk->used = 1;
+	} else {
+		size_t i = slab_index(cache, slab);
+		uint8_t o;
+		/* The buddies are free, merge them right away. */
+		for (o = slab->order; o < order; o++, i >>= 1) {
+			slab_chunk_del_free(cache, chunk, o, i + 1);
+			cache->counters[o].merges++;
+		}
+		/* Free the upper halves, the data stays in the lower. */
+		slab_chunk_split(cache, chunk, slab->order, i, order);
+		if (order == cache->order_max) {
+			/* The arena slab is whole again. */
+			slab_chunk_tree_remove(&cache->chunk_tree, chunk);
+			slab_chunk_free(cache, chunk);
+		}
+	}
+	slab->order = order;
+	slab->size = slab_order_size(cache, order);
+	cache->orders[slab->order].stats.total += slab->size;
+	cache->orders[slab->order].stats.used += slab->size;
+	cache->allocated.stats.used += slab->size;
+	slab->in_use = 1 + slab->order;
+	VALGRIND_MEMPOOL_CHANGE(cache, slab_data(slab), slab_data(slab),
+				slab_capacity(slab));
+	if (new_capacity > old_capacity) {
+		VALGRIND_MAKE_MEM_UNDEFINED((char *) slab_data(slab) +
+					    old_capacity,
+					    new_capacity - old_capacity);
+	}
+	slab_assert(cache, slab);
+	return slab;
+}
+
+void
+slab_cache_set_refill_max(struct slab_cache *cache, uint8_t refill_max)
+{
+	cache->refill_max = MAX(MIN(refill_max, SLAB_CACHE_REFILL_MAX), 1);
+	cache->refill_batch = MIN(cache->refill_batch, cache->refill_max);
+}
+
+void
+slab_cache_set_retention(struct slab_cache *cache,
+			 const struct slab_cache_retention *retention)
+{
+	cache->retention = *retention;
+	cache->retained_tick = quota_clock();
+	cache->retained_low = cache->retained;
+	slab_cache_trim(cache);
+}
+
+/**
+ * Give a free ordered slab back to the buddy system: merge it
+ * with its free buddies and put the arena slab to the cache once
+ * it is whole again.
+ */
+static void
+slab_cache_merge(struct slab_cache *cache, struct slab *slab)
+{
+	if (slab->order < cache->order_max) {
+		/*
+		 * Merge the slab with its free buddies. The buddy
+		 * could also have been split into a pair of smaller
+		 * slabs, the first of which happens to be free: the
+		 * bitmap only has bits for slabs which are free and
+		 * not split, so such a buddy is not merged.
+		 *
+		 * A slab is not accounted in "used" or "total"
+		 * counters if it was split into slabs of a lower
+		 * order. cache->orders statistics only contains sizes
+		 * of either slabs returned by slab_get, free slabs, or
+		 * the meta slabs. This ensures that sums of
+		 * cache->orders[i].stats match the totals in
+		 * cache->allocated.stats.
+		 */
+		struct slab_chunk *chunk = slab_chunk(cache, slab);
+		uint8_t order = slab->order;
+		size_t i = slab_index(cache, slab);
+		cache->orders[order].stats.total -= slab->size;
+		while (order < cache->order_max &&
+		       slab_chunk_is_free(cache, chunk, order, i ^ 1)) {
+			slab_chunk_del_free(cache, chunk, order, i ^ 1);
+			cache->counters[order].merges++;
+			order++;
+			i >>= 1;
+		}
+		/* The chunk is whole again once the last slab is put. */
+		if (--chunk->used > 0) {
+			assert(order < cache->order_max);
+			slab_chunk_add_free(cache, chunk, order, i);
+			slab_chunk_release_host(cache, chunk);
+			return;
+		}
+		assert(order == cache->order_max);
+		slab = slab_chunk_destroy(cache, chunk);
+	}
+	slab_cache_put_max(cache, slab);
+}
+
 /** Return a slab back to the slab cache. */
 void
 slab_put_with_order(struct slab_cache *cache, struct slab *slab)
@@ -334,46 +1265,66 @@ slab_put_with_order(struct slab_cache *cache, struct slab *slab)
 	assert(slab->order <= cache->order_max);
 	/* An "ordered" slab is returned to the cache. */
 	slab_set_free(cache, slab);
-	struct slab *buddy = slab_buddy(cache, slab);
+	slab_poison(slab);
+	slab_cache_merge(cache, slab);
+}
+
+void
+slab_put_remote(struct slab_cache *cache, struct slab *slab)
+{
+	assert(slab->magic == slab_magic);
 	/*
-	 * The buddy slab could also have been split into a pair
-	 * of smaller slabs, the first of which happens to be
-	 * free. To not merge with a slab which is in fact
-	 * partially occupied, first check that slab orders match.
-	 *
-	 * A slab is not accounted in "used" or "total" counters
-	 * if it was split into slabs of a lower order.
-	 * cache->orders statistics only contains sizes of either
-	 * slabs returned by slab_get, or present in the free
-	 * list. This ensures that sums of cache->orders[i].stats
-	 * match the totals in cache->allocated.stats.
+	 * A plain Treiber push is ABA-safe here: the only pop
+	 * detaches the whole list, so if the head is the same,
+	 * it is the right next link for the slab.
 	 */
-	if (buddy && buddy->order == slab->order && slab_is_free(buddy)) {
-		cache->orders[slab->order].stats.total -= slab->size;
-		do {
-			slab = slab_merge(cache, slab, buddy);
-			buddy = slab_buddy(cache, slab);
-		} while (buddy && buddy->order == slab->order &&
-			 slab_is_free(buddy));
-		cache->orders[slab->order].stats.total += slab->size;
+	struct rlist *head = pm_atomic_load(&cache->remote_free);
+	do {
+		slab->next_in_list.next = head;
+	} while (!pm_atomic_compare_exchange_weak(&cache->remote_free, &head,
+						  &slab->next_in_list));
+}
+
+void
+slab_cache_drain_remote(struct slab_cache *cache)
+{
+	struct rlist *link = pm_atomic_exchange(&cache->remote_free, NULL);
+	while (link != NULL) {
+		struct slab *slab = rlist_entry(link, struct slab,
+						next_in_list);
+		link = link->next;
+		slab_put(cache, slab);
 	}
-	slab_poison(slab);
-	if (slab->order == cache->order_max &&
-	    !rlist_empty(&cache->orders[slab->order].slabs)) {
-		/*
-		 * Largest slab should be returned to arena, but we do so
-		 * only if the slab cache has at least one slab of that size
-		 * in order to avoid oscillations.
-		 */
-		assert(slab->size == cache->arena->slab_size);
+	if (pm_atomic_exchange(&cache->shrink_requested, false))
+		slab_cache_shrink(cache);
+}
+
+size_t
+slab_cache_shrink(struct slab_cache *cache)
+{
+	struct slab_list *list = &cache->orders[cache->order_max];
+	void *slabs[SLAB_CACHE_REFILL_MAX];
+	size_t count = 0;
+	size_t size = 0;
+	while (!rlist_empty(&list->slabs)) {
+		struct slab *slab = rlist_first_entry(&list->slabs,
+						      struct slab,
+						      next_in_list);
+		slab_list_del(list, slab, next_in_list);
 		slab_list_del(&cache->allocated, slab, next_in_cache);
-		cache->orders[slab->order].stats.total -= slab->size;
-		slab_unmap(cache->arena, slab);
-	} else {
-		/* Put the slab to the cache */
-		rlist_add_entry(&cache->orders[slab->order].slabs, slab,
-				next_in_list);
+		slabs[count++] = slab;
+		size += slab->size;
+		if (count == SLAB_CACHE_REFILL_MAX) {
+			slab_unmap_batch(cache->arena, slabs, count);
+			count = 0;
+		}
 	}
+	slab_unmap_batch(cache->arena, slabs, count);
+	cache->refill_batch = 1;
+	/* Nothing is left to decay, start a new period. */
+	cache->retained = cache->retained_low = 0;
+	cache->retained_tick = quota_clock();
+	return size + slab_cache_release_large(cache);
 }
 
 void
@@ -384,6 +1335,30 @@ slab_put(struct slab_cache *cache, struct slab *slab)
 	return slab_put_large(cache, slab);
 }
 
+void
+slab_cache_stats(struct slab_cache *cache, struct slab_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->order_count = cache->order_max + 1;
+	stats->largest_free_order = -1;
+	uint8_t order;
+	for (order = 0; order <= cache->order_max; order++) {
+		struct slab_list *list = &cache->orders[order];
+		struct slab_order_stats *order_stats = &stats->orders[order];
+		size_t size = slab_order_size(cache, order);
+		order_stats->used = list->stats.used / size;
+		order_stats->free = (list->stats.total - list->stats.used) /
+				    size;
+		/* The meta slabs are neither free nor used. */
+		if (order == cache->meta_order)
+			order_stats->free -= cache->meta_slabs;
+		order_stats->counters = cache->counters[order];
+		if (order_stats->free > 0)
+			stats->largest_free_order = order;
+	}
+	stats->large = cache->counters[cache->order_max + 1];
+}
+
 void
 slab_cache_check(struct slab_cache *cache)
 {
@@ -391,6 +1366,7 @@ slab_cache_check(struct slab_cache *cache)
 	size_t used = 0;
 	size_t ordered = 0;
 	size_t huge = 0;
+	size_t huge_free = 0;
 	bool dont_panic = true;
 
 	struct rlist *slabs = &cache->allocated.slabs;
@@ -405,7 +1381,10 @@ slab_cache_check(struct slab_cache *cache)
 		}
 		if (slab->order == cache->order_max + 1) {
 			huge += slab->size;
-			used += slab->size;
+			if (!slab_is_free(slab))
+				used += slab->size;
+			else
+				huge_free += slab->size;
 			total += slab->size;
 		} else {
 			if ((intptr_t) slab->size !=
@@ -455,8 +1434,55 @@ slab_cache_check(struct slab_cache *cache)
 				slab_order_size(cache, order));
 			dont_panic = false;
 		}
+		uint8_t o = list - cache->orders;
+		if (o == cache->order_max)
+			continue;
+		struct rlist *link;
+		rlist_foreach(link, &list->slabs) {
+			struct slab_chunk *chunk = slab_chunk_from_link(link, o);
+			uint32_t count = 0;
+			size_t i;
+			for (i = 0; i < ((size_t) 1 << (cache->order_max - o));
+			     i++)
+				count += slab_chunk_is_free(cache, chunk, o, i);
+			if (count != chunk->free_count[o]) {
+				fprintf(stderr, "%s: incorrect buddy bitmap,"
+					" order %u has %u free slabs, counted"
+					" %u\n", __func__, (unsigned) o,
+					chunk->free_count[o], count);
+				dont_panic = false;
+			}
+		}
 	}
 
+	uint32_t retained = 0;
+	rlist_foreach_entry(slab, &cache->orders[cache->order_max].slabs,
+			    next_in_list)
+		retained++;
+	if (retained != cache->retained) {
+		fprintf(stderr, "%s: incorrect retained slab count %u,"
+			" factual %u\n", __func__, cache->retained, retained);
+		dont_panic = false;
+	}
+	uint32_t meta_slabs = 0;
+	uint32_t chunks = 0;
+	struct slab_meta *meta;
+	rlist_foreach_entry(meta, &cache->meta, slab.next_in_list) {
+		meta_slabs++;
+		chunks += meta->used;
+	}
+	if (meta_slabs != cache->meta_slabs || chunks != cache->chunks) {
+		fprintf(stderr, "%s: incorrect buddy metadata, %u meta slabs"
+			" with %u chunks, factual %u with %u\n", __func__,
+			cache->meta_slabs, cache->chunks, meta_slabs, chunks);
+		dont_panic = false;
+	}
+	if (huge_free != cache->large_free.stats.total) {
+		fprintf(stderr, "%s: incorrect free huge slabs total %zu,"
+			" factual %zu\n", __func__,
+			cache->large_free.stats.total, huge_free);
+		dont_panic = false;
+	}
 	if (ordered + huge != total) {
 		fprintf(stderr, "%s: incorrect totals, ordered %zu, "
 			" huge %zu, total %zu\n", __func__,
@@ -481,6 +1507,6 @@ slab_real_size(struct slab_cache *cache, size_t size)
 	size += slab_sizeof();
 	uint8_t order = slab_order(cache, size);
 	if (order == cache->order_max + 1)
-		return size;
+		return slab_large_size(size - slab_sizeof());
 	return slab_order_size(cache, order);
 }
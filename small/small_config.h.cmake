@@ -28,4 +28,22 @@
 # define TARANTOOL_SMALL_USE_MADVISE 1
 #endif
 
+/*
+ * Defined if this platform supports huge pages, either
+ * explicit (hugetlbfs) or transparent ones.
+ */
+#cmakedefine TARANTOOL_SMALL_HAVE_MAP_HUGETLB 1
+#cmakedefine TARANTOOL_SMALL_HAVE_MADV_HUGEPAGE 1
+
+#if defined(TARANTOOL_SMALL_HAVE_MADVISE)	&& \
+    defined(TARANTOOL_SMALL_HAVE_MADV_HUGEPAGE)
+# define TARANTOOL_SMALL_USE_THP 1
+#endif
+
+/*
+ * Defined if this platform has mbind(..) syscall
+ * to bind memory to NUMA nodes.
+ */
+#cmakedefine TARANTOOL_SMALL_HAVE_MBIND 1
+
 #endif /* TARANTOOL_SMALL_CONFIG_H_INCLUDED */
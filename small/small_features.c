@@ -41,6 +41,11 @@
 #include "small_config.h"
 #include "util.h"
 
+#ifdef TARANTOOL_SMALL_HAVE_MBIND
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 typedef bool (*rt_helper_t)(void);
 
 #define SMALL_FEATURE_MASK(v)	((uint64_t)1 << (v))
@@ -49,9 +54,39 @@ typedef bool (*rt_helper_t)(void);
 static uint64_t builtin_mask =
 #ifdef TARANTOOL_SMALL_USE_MADVISE
 	SMALL_FEATURE_MASK(SMALL_FEATURE_DONTDUMP)	|
+#endif
+#ifdef TARANTOOL_SMALL_HAVE_MAP_HUGETLB
+	SMALL_FEATURE_MASK(SMALL_FEATURE_HUGEPAGE)	|
+#endif
+#ifdef TARANTOOL_SMALL_USE_THP
+	SMALL_FEATURE_MASK(SMALL_FEATURE_THP)		|
+#endif
+#ifdef TARANTOOL_SMALL_HAVE_MBIND
+	SMALL_FEATURE_MASK(SMALL_FEATURE_NUMA)		|
 #endif
 	0;
 
+size_t
+small_gethugepagesize(void)
+{
+	size_t size = 0;
+#if defined(__linux__)
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return 0;
+	char buf[128];
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		unsigned long kb;
+		if (sscanf(buf, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = (size_t)kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+#endif
+	return size;
+}
+
 #ifdef TARANTOOL_SMALL_USE_MADVISE
 static bool
 test_dontdump(void)
@@ -97,11 +132,102 @@ out:
 static bool test_dontdump(void) { return false; }
 #endif
 
+#ifdef TARANTOOL_SMALL_HAVE_MAP_HUGETLB
+static bool
+test_hugepage(void)
+{
+	size_t size = small_gethugepagesize();
+	intptr_t ignore_it;
+	char buf[64];
+	void *ptr;
+
+	(void)ignore_it;
+
+	if (size == 0)
+		return false;
+
+	/*
+	 * MAP_HUGETLB is known to the kernel but fails
+	 * unless there are huge pages reserved, so the
+	 * only reliable way is to try to map one.
+	 */
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if (ptr == MAP_FAILED)
+		return false;
+
+	if (munmap(ptr, size)) {
+		ignore_it = (intptr_t)strerror_r(errno, buf, sizeof(buf));
+		fprintf(stderr, "Error in munmap(%p, %zu): %s\n",
+			ptr, size, buf);
+	}
+	return true;
+}
+#else
+static bool test_hugepage(void) { return false; }
+#endif
+
+#ifdef TARANTOOL_SMALL_USE_THP
+static bool
+test_thp(void)
+{
+	size_t size = small_getpagesize();
+	intptr_t ignore_it;
+	bool ret = false;
+	char buf[64];
+	void *ptr;
+
+	(void)ignore_it;
+
+	/*
+	 * MADV_HUGEPAGE fails with EINVAL if the kernel
+	 * is built without transparent huge pages.
+	 */
+	ptr = mmap(NULL, size, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		ignore_it = (intptr_t)strerror_r(errno, buf, sizeof(buf));
+		fprintf(stderr, "Error in mmap(NULL, %zu, ...): %s\n", size, buf);
+		goto out;
+	}
+
+	if (madvise(ptr, size, MADV_HUGEPAGE) == 0)
+		ret = true;
+
+	if (munmap(ptr, size)) {
+		ignore_it = (intptr_t)strerror_r(errno, buf, sizeof(buf));
+		fprintf(stderr, "Error in munmap(%p, %zu): %s\n",
+			ptr, size, buf);
+	}
+out:
+	return ret;
+}
+#else
+static bool test_thp(void) { return false; }
+#endif
+
+#ifdef TARANTOOL_SMALL_HAVE_MBIND
+static bool
+test_numa(void)
+{
+	/*
+	 * Memory policy syscalls return ENOSYS if
+	 * the kernel is built without NUMA support.
+	 */
+	int mode;
+	return syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0) == 0;
+}
+#else
+static bool test_numa(void) { return false; }
+#endif
+
 /*
  * Runtime testers, put there features if they are dynamic.
  */
 static rt_helper_t rt_helpers[FEATURE_MAX] = {
 	[SMALL_FEATURE_DONTDUMP]	= test_dontdump,
+	[SMALL_FEATURE_HUGEPAGE]	= test_hugepage,
+	[SMALL_FEATURE_THP]		= test_thp,
+	[SMALL_FEATURE_NUMA]		= test_numa,
 };
 
 /**
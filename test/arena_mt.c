@@ -49,8 +49,43 @@ run(void *p __attribute__((unused)))
 	return 0;
 }
 
+void *
+run_cached(void *p __attribute__((unused)))
+{
+#ifdef __FreeBSD__
+	unsigned int seed = pthread_getthreadid_np();
+#else
+	unsigned int seed = (intptr_t) pthread_self();
+#endif
+	struct slab_thread_cache cache;
+	slab_thread_cache_create(&cache, &arena);
+	int iterations = rand_r(&seed) % ITERATIONS;
+	pthread_t **slabs = slab_thread_cache_map(&cache);
+	for (int i = 0; i < iterations; i++) {
+		int oscillation = rand_r(&seed) % OSCILLATION;
+		for (int osc = 0; osc  < oscillation; osc++) {
+			slabs[osc] = (pthread_t *)
+				slab_thread_cache_map(&cache);
+			for (int fill = 0; fill < FILL; fill += 100) {
+				slabs[osc][fill] = pthread_self();
+			}
+		}
+		sched_yield();
+		for (int osc = 0; osc  < oscillation; osc++) {
+			for (int fill = 0; fill < FILL; fill+= 100) {
+				fail_unless(slabs[osc][fill] ==
+					    pthread_self());
+			}
+			slab_thread_cache_unmap(&cache, slabs[osc]);
+		}
+	}
+	slab_thread_cache_unmap(&cache, slabs);
+	slab_thread_cache_destroy(&cache);
+	return 0;
+}
+
 void
-bench(int count)
+bench(int count, void *(*f)(void *))
 {
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
@@ -59,7 +94,7 @@ bench(int count)
 
 	int i;
 	for (i = 0; i < count; i++) {
-		pthread_create(&threads[i], &attr, run, NULL);
+		pthread_create(&threads[i], &attr, f, NULL);
 	}
 	for (i = 0; i < count; i++) {
 		pthread_t *thread = &threads[i];
@@ -71,11 +106,14 @@ bench(int count)
 int
 main()
 {
-	size_t maxalloc = THREADS * (OSCILLATION + 1) * SLAB_MIN_SIZE;
+	/* Slabs in magazines of thread caches are accounted too. */
+	size_t maxalloc = THREADS * (OSCILLATION + 1 + 2 * SLAB_MAGAZINE_SIZE) *
+			  SLAB_MIN_SIZE;
 	quota_init(&quota, maxalloc);
 	slab_arena_create(&arena, &quota, maxalloc/8,
 			  SLAB_MIN_SIZE, MAP_PRIVATE);
-	bench(THREADS);
+	bench(THREADS, run);
+	bench(THREADS, run_cached);
 	slab_arena_destroy(&arena);
 	printf("ok\n");
 }
@@ -1,5 +1,6 @@
 #include <small/lf_lifo.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "unit.h"
 
 #if !defined(MAP_ANONYMOUS)
@@ -30,6 +31,57 @@ mmap_aligned(size_t size)
 
 #define MAP_SIZE 0x10000
 
+enum {
+	THREAD_COUNT = 8,
+	ELEM_COUNT = 8,
+	ITERATIONS = 20000,
+};
+
+static struct lf_lifo_elim elim;
+
+static void *
+elim_thread_f(void *arg)
+{
+	(void)arg;
+	void *taken[ELEM_COUNT];
+	for (int i = 0; i < ITERATIONS; i++) {
+		int n = 0;
+		while (n < ELEM_COUNT &&
+		       (taken[n] = lf_lifo_elim_pop(&elim)) != NULL)
+			n++;
+		while (n > 0)
+			lf_lifo_elim_push(&elim, taken[--n]);
+	}
+	return NULL;
+}
+
+static void
+test_elim(void)
+{
+	char *vals[THREAD_COUNT * ELEM_COUNT];
+	lf_lifo_elim_init(&elim);
+	for (int i = 0; i < THREAD_COUNT * ELEM_COUNT; i++) {
+		vals[i] = mmap_aligned(MAP_SIZE);
+		vals[i][sizeof(struct lf_lifo)] = 0;
+		lf_lifo_elim_push(&elim, vals[i]);
+	}
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; i++)
+		pthread_create(&threads[i], NULL, elim_thread_f, NULL);
+	for (int i = 0; i < THREAD_COUNT; i++)
+		pthread_join(threads[i], NULL);
+	/* No element is lost or duplicated. */
+	char *val;
+	while ((val = lf_lifo_elim_pop(&elim)) != NULL) {
+		fail_unless(val[sizeof(struct lf_lifo)] == 0);
+		val[sizeof(struct lf_lifo)] = 1;
+	}
+	for (int i = 0; i < THREAD_COUNT * ELEM_COUNT; i++) {
+		fail_unless(vals[i][sizeof(struct lf_lifo)] == 1);
+		munmap(vals[i], MAP_SIZE);
+	}
+}
+
 int main()
 {
 	struct lf_lifo head;
@@ -47,6 +99,25 @@ int main()
 	fail_unless(lf_lifo_pop(&head) == val1);
 	fail_unless(lf_lifo_pop(&head) == NULL);
 
+	/* Test chains. */
+	fail_unless(lf_lifo_pop_all(&head) == NULL);
+	lf_lifo(val1)->next = val2;
+	lf_lifo_push_chain(&head, val1, val2);
+	lf_lifo_push(&head, val3);
+	fail_unless(lf_lifo_pop_all(&head) == val3);
+	fail_unless(lf_lifo(lf_lifo(val3)->next) == val1);
+	fail_unless(lf_lifo(lf_lifo(val1)->next) == val2);
+	fail_unless(lf_lifo(lf_lifo(val2)->next) == NULL);
+	fail_unless(lf_lifo_pop(&head) == NULL);
+
+	void *vals[3];
+	lf_lifo_push(lf_lifo_push(lf_lifo_push(&head, val1), val2), val3);
+	fail_unless(lf_lifo_pop_n(&head, vals, 2) == 2);
+	fail_unless(vals[0] == val3 && vals[1] == val2);
+	fail_unless(lf_lifo_pop_n(&head, vals, 2) == 1);
+	fail_unless(vals[0] == val1);
+	fail_unless(lf_lifo_pop_n(&head, vals, 2) == 0);
+
 	lf_lifo_init(&head);
 
 	/* Test overflow of ABA counter. */
@@ -61,6 +132,8 @@ int main()
 	munmap(val2, MAP_SIZE);
 	munmap(val3, MAP_SIZE);
 
+	test_elim();
+
 	printf("success\n");
 
 	return 0;
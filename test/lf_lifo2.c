@@ -0,0 +1,77 @@
+#include <small/lf_lifo2.h>
+#include <pthread.h>
+#include "unit.h"
+
+enum {
+	THREAD_COUNT = 8,
+	ELEM_COUNT = 64,
+	ITERATIONS = 20000,
+};
+
+struct elem {
+	void *link;
+	int thread;
+};
+
+static struct lf_lifo2 stack;
+static struct elem elems[THREAD_COUNT * ELEM_COUNT];
+
+static void *
+thread_f(void *arg)
+{
+	(void)arg;
+	struct elem *taken[ELEM_COUNT];
+	for (int i = 0; i < ITERATIONS; i++) {
+		int n = 0;
+		while (n < ELEM_COUNT &&
+		       (taken[n] = lf_lifo2_pop(&stack)) != NULL)
+			n++;
+		while (n > 0)
+			lf_lifo2_push(&stack, taken[--n]);
+	}
+	return NULL;
+}
+
+int main()
+{
+	struct lf_lifo2 head;
+	/* Elements only need to be pointer-aligned. */
+	struct elem *val1 = &elems[0], *val2 = &elems[1], *val3 = &elems[2];
+	lf_lifo2_init(&head);
+
+	fail_unless(lf_lifo2_pop(&head) == NULL);
+	fail_unless(lf_lifo2_pop(lf_lifo2_push(&head, val1)) == val1);
+	lf_lifo2_push(lf_lifo2_push(lf_lifo2_push(&head, val1), val2), val3);
+	fail_unless(lf_lifo2_pop(&head) == val3);
+	fail_unless(lf_lifo2_pop(&head) == val2);
+	fail_unless(lf_lifo2_pop(&head) == val1);
+	fail_unless(lf_lifo2_pop(&head) == NULL);
+	fail_unless(lf_lifo2_is_empty(&head));
+	fail_unless(head.tag == 8);
+
+	lf_lifo2_push(lf_lifo2_push(&head, val1), val2);
+	fail_unless(lf_lifo2_pop_all(&head) == val2);
+	fail_unless(val2->link == val1 && val1->link == NULL);
+	fail_unless(lf_lifo2_pop_all(&head) == NULL);
+
+	/* Concurrent pops and pushes don't lose elements. */
+	lf_lifo2_init(&stack);
+	for (int i = 0; i < THREAD_COUNT * ELEM_COUNT; i++)
+		lf_lifo2_push(&stack, &elems[i]);
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; i++)
+		pthread_create(&threads[i], NULL, thread_f, NULL);
+	for (int i = 0; i < THREAD_COUNT; i++)
+		pthread_join(threads[i], NULL);
+	struct elem *elem;
+	while ((elem = lf_lifo2_pop(&stack)) != NULL) {
+		fail_unless(elem->thread == 0);
+		elem->thread = 1;
+	}
+	for (int i = 0; i < THREAD_COUNT * ELEM_COUNT; i++)
+		fail_unless(elems[i].thread == 1);
+
+	printf("success\n");
+
+	return 0;
+}
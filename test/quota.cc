@@ -58,6 +58,161 @@ void *thread_routine(void *vparam)
 	return (void *)check_fail_count;
 }
 
+static void
+test_hierarchy()
+{
+	struct quota root, tuples, indexes, read_views;
+	const size_t unit = QUOTA_UNIT_SIZE;
+	quota_init(&root, 10 * unit);
+	quota_init_child(&tuples, &root, 8 * unit);
+	quota_init_child(&indexes, &root, 4 * unit);
+	quota_init_child(&read_views, &indexes, 4 * unit);
+
+	bool success = quota_use(&tuples, 6 * unit) > 0 &&
+		       quota_use(&read_views, 2 * unit) > 0;
+	ok(success && quota_used(&tuples) == 6 * unit &&
+	   quota_used(&read_views) == 2 * unit &&
+	   quota_used(&indexes) == 2 * unit &&
+	   quota_used(&root) == 8 * unit, "use is propagated to ancestors");
+
+	ok(quota_use(&tuples, 4 * unit) < 0 &&
+	   quota_used(&tuples) == 6 * unit && quota_used(&root) == 8 * unit,
+	   "child limit is respected");
+
+	ok(quota_use(&read_views, 3 * unit) < 0 &&
+	   quota_used(&read_views) == 2 * unit &&
+	   quota_used(&indexes) == 2 * unit &&
+	   quota_used(&root) == 8 * unit,
+	   "use is rolled back if a parent limit is reached");
+
+	quota_release(&tuples, 6 * unit);
+	quota_release(&read_views, 2 * unit);
+	ok(quota_used(&tuples) == 0 && quota_used(&read_views) == 0 &&
+	   quota_used(&indexes) == 0 && quota_used(&root) == 0,
+	   "release is propagated to ancestors");
+}
+
+static void
+test_large()
+{
+	struct quota q;
+	const size_t big = QUOTA_MAX / 4 * 3;
+	quota_init(&q, QUOTA_MAX);
+	ok(quota_use(&q, big) == (ssize_t)quota_align(big) &&
+	   quota_use(&q, big) < 0 && quota_used(&q) == quota_align(big),
+	   "limit is not capped by 32 bit units");
+	ok(quota_use(&q, 1) == (ssize_t)QUOTA_UNIT_SIZE &&
+	   quota_used(&q) == quota_align(big) + QUOTA_UNIT_SIZE &&
+	   QUOTA_UNIT_SIZE == 64, "small sizes are rounded to a cache line");
+}
+
+static void
+test_sharded()
+{
+	struct quota q;
+	struct quota_shard shards[4];
+	const size_t unit = QUOTA_UNIT_SIZE;
+	quota_init(&q, 10 * unit);
+	quota_shards_create(&q, shards, 4, 4 * unit);
+
+	ok(quota_use(&q, unit) == (ssize_t)unit &&
+	   quota_used(&q) == 5 * unit, "shard takes the slack at once");
+
+	int count = 1;
+	while (quota_use(&q, unit) > 0)
+		count++;
+	ok(count == 10 && quota_used(&q) == 10 * unit,
+	   "limit is respected and all the slack is used");
+
+	for (int i = 0; i < count; i++)
+		quota_release(&q, unit);
+	ok(quota_used(&q) <= 8 * unit && quota_set(&q, unit) > 0 &&
+	   quota_used(&q) == 0, "shards are flushed to decrease the limit");
+
+	quota_set(&q, 10 * unit);
+	quota_use(&q, unit);
+	quota_shards_destroy(&q);
+	ok(quota_used(&q) == unit && quota_use(&q, unit) > 0 &&
+	   quota_used(&q) == 2 * unit, "quota works after unsharding");
+}
+
+static void
+watermark_cb(struct quota *q, enum quota_watermark watermark, void *arg)
+{
+	(void)q;
+	int *crossings = (int *)arg;
+	crossings[watermark]++;
+}
+
+static void
+test_watermarks()
+{
+	struct quota q;
+	const size_t unit = QUOTA_UNIT_SIZE;
+	int crossings[2] = {0, 0};
+	quota_init(&q, 10 * unit);
+	quota_set_watermarks(&q, 4 * unit, 8 * unit, watermark_cb, crossings);
+
+	quota_use(&q, 7 * unit);
+	ok(crossings[QUOTA_WATERMARK_HIGH] == 0 &&
+	   crossings[QUOTA_WATERMARK_LOW] == 0, "no crossing below high");
+	quota_use(&q, unit);
+	quota_use(&q, unit);
+	quota_release(&q, 2 * unit);
+	quota_use(&q, unit);
+	ok(crossings[QUOTA_WATERMARK_HIGH] == 1 &&
+	   crossings[QUOTA_WATERMARK_LOW] == 0, "high fires once");
+	quota_release(&q, 3 * unit);
+	quota_release(&q, unit);
+	quota_use(&q, 3 * unit);
+	quota_release(&q, 3 * unit);
+	ok(crossings[QUOTA_WATERMARK_HIGH] == 1 &&
+	   crossings[QUOTA_WATERMARK_LOW] == 1, "low fires once");
+	quota_use(&q, 4 * unit);
+	ok(crossings[QUOTA_WATERMARK_HIGH] == 2, "high fires again");
+}
+
+static void *
+wait_routine(void *arg)
+{
+	struct quota *q = (struct quota *)arg;
+	return (void *)quota_use_wait(q, 2 * QUOTA_UNIT_SIZE);
+}
+
+static void
+test_wait()
+{
+	struct quota q;
+	const size_t unit = QUOTA_UNIT_SIZE;
+	quota_init(&q, 4 * unit);
+
+	ok(quota_use(&q, 3 * unit) > 0 &&
+	   quota_use_timed(&q, 2 * unit, 0.01) < 0 && errno == ETIMEDOUT &&
+	   quota_used(&q) == 3 * unit, "use times out if quota is exhausted");
+	ok(quota_use_wait(&q, QUOTA_MAX + 1) < 0 && errno == EINVAL,
+	   "use fails right away if size exceeds the max quota");
+
+	pthread_t thread;
+	pthread_create(&thread, 0, wait_routine, &q);
+	/* Let the thread block. */
+	while (pm_atomic_load(&q.waiters) == 0)
+		sched_yield();
+	quota_release(&q, 3 * unit);
+	void *ret;
+	pthread_join(thread, &ret);
+	ok((ssize_t)ret == (ssize_t)(2 * unit) && quota_used(&q) == 2 * unit,
+	   "waiter is woken up by release");
+
+	quota_use(&q, 2 * unit);
+	pthread_create(&thread, 0, wait_routine, &q);
+	while (pm_atomic_load(&q.waiters) == 0)
+		sched_yield();
+	quota_set(&q, 6 * unit);
+	pthread_join(thread, &ret);
+	ok((ssize_t)ret == (ssize_t)(2 * unit) && quota_used(&q) == 6 * unit,
+	   "waiter is woken up by limit increase");
+}
+
 int
 main(int n, char **a)
 {
@@ -66,7 +221,7 @@ main(int n, char **a)
 	quota_init(&quota, 0);
 	srand(time(0));
 
-	plan(5);
+	plan(23);
 
 	for (size_t i = 0; i < THREAD_CNT; i++) {
 		pthread_create(threads + i, 0, thread_routine, (void *)(datum + i));
@@ -96,5 +251,11 @@ main(int n, char **a)
 	ok(use_success_count > THREAD_CNT * RUN_CNT * .1, "uses are mosly successful");
 	ok(set_success_count > THREAD_CNT * RUN_CNT * .1, "sets are mosly successful");
 
+	test_hierarchy();
+	test_wait();
+	test_large();
+	test_sharded();
+	test_watermarks();
+
 	return check_plan();
 }
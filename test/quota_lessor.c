@@ -24,25 +24,30 @@ test_basic()
 	   "source quota used did not change");
 
 	/* Lease several LEASE_SIZEs. */
+	size_t tail = quota_align(300);
 	is(QUOTA_USE_MIN * 3, quota_lease(&l, QUOTA_USE_MIN * 3), "lease big size");
 	is(QUOTA_USE_MIN * 3 + 300, quota_leased(&l), "leased size");
-	is(QUOTA_UNIT_SIZE - 300, quota_available(&l), "available size");
-	is(QUOTA_USE_MIN * 3 + QUOTA_UNIT_SIZE, quota_used(&q),
+	is(tail - 300, quota_available(&l), "available size");
+	is(QUOTA_USE_MIN * 3 + tail, quota_used(&q),
 	   "update source quota used");
 
 	/* End lease. */
 	quota_end_lease(&l, 300);
-	is(QUOTA_UNIT_SIZE, quota_available(&l), "end small lease");
+	is(tail, quota_available(&l), "end small lease");
 	is(QUOTA_USE_MIN * 3, quota_leased(&l), "decrease leased");
-	is(QUOTA_USE_MIN * 3 + QUOTA_UNIT_SIZE, quota_used(&q),
+	is(QUOTA_USE_MIN * 3 + tail, quota_used(&q),
 	   "source quota did not change - too small size to free");
 
 	quota_end_lease(&l, QUOTA_USE_MIN * 2 + 100);
+	/* All but QUOTA_USE_MIN + QUOTA_UNIT_SIZE is released. */
+	size_t released = quota_align(QUOTA_USE_MIN + tail + 100 -
+				      QUOTA_UNIT_SIZE);
 	is(QUOTA_USE_MIN - 100, quota_leased(&l),
 	   "decrease leased with big chunk");
-	is(100 + QUOTA_USE_MIN, quota_available(&l),
+	is(QUOTA_USE_MIN * 2 + tail + 100 - released, quota_available(&l),
 	   "return big chunks into source quota");
-	is(QUOTA_USE_MIN * 2, quota_used(&q), "release source quota");
+	is(QUOTA_USE_MIN * 3 + tail - released, quota_used(&q),
+	   "release source quota");
 
 	quota_end_lease(&l, QUOTA_USE_MIN - 100);
 	is(0, quota_leased(&l), "lessor is empty");
@@ -89,11 +94,46 @@ test_hard_lease()
 	check_plan();
 }
 
+void
+test_adaptive_lease()
+{
+	plan(5);
+	struct quota q;
+	quota_init(&q, QUOTA_MAX);
+	struct quota_lessor l;
+
+	/* An idle lessor takes small chunks. */
+	quota_lessor_create(&l, &q);
+	usleep(QUOTA_LESSOR_WINDOW * 1.1e6);
+	is(100, quota_lease(&l, 100), "lease after a window");
+	is(QUOTA_LESSOR_USE_MIN_LOW, quota_used(&q), "idle lessor takes less");
+	quota_end_lease(&l, 100);
+	quota_lessor_destroy(&l);
+
+	/* A busy lessor takes big chunks. */
+	quota_lessor_create(&l, &q);
+	double start = quota_clock();
+	while (quota_clock() - start < QUOTA_LESSOR_WINDOW * 1.5) {
+		quota_lease(&l, 64 * 1024);
+		quota_end_lease(&l, 64 * 1024);
+	}
+	is(true, quota_lease_rate(&l) > QUOTA_USE_MIN / QUOTA_LESSOR_WINDOW,
+	   "lease rate is measured");
+	is(QUOTA_USE_MIN * 2, quota_lease(&l, QUOTA_USE_MIN * 2),
+	   "lease after rate update");
+	is(true, quota_used(&q) > QUOTA_USE_MIN * 2, "busy lessor takes more");
+	quota_end_lease(&l, QUOTA_USE_MIN * 2);
+	quota_lessor_destroy(&l);
+
+	check_plan();
+}
+
 int
 main()
 {
-	plan(2);
+	plan(3);
 	test_basic();
 	test_hard_lease();
+	test_adaptive_lease();
 	return check_plan();
 }
@@ -1,11 +1,16 @@
 #include <small/slab_arena.h>
 #include <small/quota.h>
+#include <small/slab_cache.h>
+#include <small/mempool.h>
+#include <small/small_features.h>
 #include <stdio.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
 #include "unit.h"
 
 void
@@ -143,6 +148,634 @@ no_dd:
 	goto out;
 }
 
+static void
+slab_test_hugepage(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	const uint32_t slab_size = 4 * 1024 * 1024;
+	void *ptr;
+
+	/*
+	 * Explicit huge pages: the arena must work regardless
+	 * of whether there are huge pages reserved or not.
+	 * The slab size must be a multiple of the huge page size.
+	 */
+	size_t hugepage_size = small_gethugepagesize();
+	uint32_t huge_slab_size = slab_size;
+	if (hugepage_size > huge_slab_size && hugepage_size <= UINT32_MAX / 2)
+		huge_slab_size = hugepage_size;
+	quota_init(&quota, 4 * (size_t)huge_slab_size);
+	void *prealloc;
+	if (slab_arena_create(&arena, &quota, huge_slab_size, huge_slab_size,
+			      SLAB_ARENA_PRIVATE | SLAB_ARENA_HUGEPAGE) != 0) {
+		if (errno != EINVAL)
+			printf("ERROR: can't create SLAB_ARENA_HUGEPAGE arena\n");
+		goto thp;
+	}
+	prealloc = slab_map(&arena);
+	ptr = slab_map(&arena);
+	if (!prealloc || !ptr) {
+		printf("ERROR: can't obtain slab with SLAB_ARENA_HUGEPAGE\n");
+	} else if (small_test_feature(SMALL_FEATURE_HUGEPAGE) &&
+		   arena.stats.hugepage_slabs != 2) {
+		printf("ERROR: expected 2 hugetlb slabs, got %zu\n",
+		       arena.stats.hugepage_slabs);
+	}
+	slab_unmap(&arena, ptr);
+	slab_unmap(&arena, prealloc);
+	slab_arena_destroy(&arena);
+thp:
+	/* A misaligned slab size is refused. */
+	if (hugepage_size > (size_t)getpagesize()) {
+		errno = 0;
+		if (slab_arena_create(&arena, &quota, 0, hugepage_size / 2,
+				      SLAB_ARENA_PRIVATE |
+				      SLAB_ARENA_HUGEPAGE) == 0 ||
+		    errno != EINVAL)
+			printf("ERROR: misaligned huge page arena created\n");
+	}
+
+	/*
+	 * Transparent huge pages: both preallocated and
+	 * dynamically allocated slabs must be advised.
+	 */
+	quota_init(&quota, 4 * slab_size);
+	slab_arena_create(&arena, &quota, slab_size, slab_size,
+			  SLAB_ARENA_PRIVATE | SLAB_ARENA_THP);
+	prealloc = slab_map(&arena);
+	ptr = slab_map(&arena);
+	if (!prealloc || !ptr) {
+		printf("ERROR: can't obtain slab with SLAB_ARENA_THP\n");
+		goto out;
+	}
+	if (!small_test_feature(SMALL_FEATURE_THP))
+		goto out;
+	if (arena.stats.hugepage_slabs != 2) {
+		printf("ERROR: expected 2 THP slabs, got %zu\n",
+		       arena.stats.hugepage_slabs);
+	}
+	if (access("/proc/self/smaps", F_OK) == 0 &&
+	    !vma_has_flag((unsigned long)ptr, "hg"))
+		printf("ERROR: Expected hg flag on VMA address %p\n", ptr);
+out:
+	slab_unmap(&arena, ptr);
+	slab_unmap(&arena, prealloc);
+	slab_arena_destroy(&arena);
+}
+
+/**
+ * Check the memory policy of a VMA containing the address.
+ * Adjacent mappings with the same policy are merged, so
+ * look for the closest VMA starting at or below the address.
+ */
+static bool
+vma_has_policy(unsigned long addr, const char *policy)
+{
+	unsigned long start, best = 0;
+	char buf[1024], found[1024] = "";
+	FILE *f;
+
+	f = fopen("/proc/self/numa_maps", "r");
+	if (!f) {
+		printf("ERROR: Can't open numa_maps for %lx\n", addr);
+		return false;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%lx", &start) != 1 ||
+		    start > addr || start < best)
+			continue;
+		best = start;
+		strcpy(found, buf);
+	}
+	fclose(f);
+
+	char *tok = strtok(found, " \n");
+	if (tok != NULL)
+		tok = strtok(NULL, " \n");
+	return tok != NULL && strcmp(tok, policy) == 0;
+}
+
+static void
+slab_test_numa(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	void *prealloc, *ptr;
+
+	if (!small_test_feature(SMALL_FEATURE_NUMA))
+		return;
+
+	quota_init(&quota, 4 * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	if (slab_arena_bind_node(&arena, -1) == 0)
+		printf("ERROR: bound to an invalid NUMA node\n");
+	if (slab_arena_bind_node(&arena, 0) != 0)
+		printf("ERROR: can't bind arena to NUMA node 0\n");
+
+	/* Both preallocated and new slabs must prefer the node. */
+	prealloc = slab_map(&arena);
+	ptr = slab_map(&arena);
+	if (!prealloc || !ptr) {
+		printf("ERROR: can't obtain slab on NUMA node 0\n");
+		goto out;
+	}
+	if (access("/proc/self/numa_maps", F_OK) != 0)
+		goto out;
+	if (!vma_has_policy((unsigned long)prealloc, "prefer:0"))
+		printf("ERROR: Expected prefer:0 policy on %p\n", prealloc);
+	if (!vma_has_policy((unsigned long)ptr, "prefer:0"))
+		printf("ERROR: Expected prefer:0 policy on %p\n", ptr);
+out:
+	slab_unmap(&arena, ptr);
+	slab_unmap(&arena, prealloc);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_purge(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	enum { SLAB_COUNT = 4 };
+	void *slabs[SLAB_COUNT];
+	size_t page = sysconf(_SC_PAGESIZE);
+	int i;
+
+	/* Half of slabs are preallocated, half are mapped. */
+	quota_init(&quota, SLAB_COUNT * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, SLAB_COUNT / 2 * SLAB_MIN_SIZE,
+			  SLAB_MIN_SIZE, SLAB_ARENA_PRIVATE);
+	for (i = 0; i < SLAB_COUNT; i++) {
+		slabs[i] = slab_map(&arena);
+		memset(slabs[i], 'x', SLAB_MIN_SIZE);
+	}
+	for (i = 0; i < SLAB_COUNT; i++)
+		slab_unmap(&arena, slabs[i]);
+
+	/* Nothing is idle for an hour yet. */
+	slab_arena_set_purge(&arena, 3600, 0);
+	if (slab_arena_trim(&arena) != 0)
+		printf("ERROR: purged slabs before the delay\n");
+
+	/* Keep the most recently cached slab intact. */
+	slab_arena_set_purge(&arena, 0, SLAB_MIN_SIZE);
+	size_t expected = (SLAB_COUNT - 1) * (SLAB_MIN_SIZE - page);
+	if (slab_arena_trim(&arena) != expected || arena.stats.purged != expected)
+		printf("ERROR: expected %zu bytes purged, got %zu\n",
+		       expected, arena.stats.purged);
+	/* Already purged slabs are skipped. */
+	if (slab_arena_trim(&arena) != 0)
+		printf("ERROR: purged slabs twice\n");
+
+	/* The cache order is preserved. */
+	for (i = SLAB_COUNT - 1; i >= 0; i--) {
+		void *ptr = slab_map(&arena);
+		if (ptr != slabs[i])
+			printf("ERROR: expected slab %p, got %p\n",
+			       slabs[i], ptr);
+		char c = ((char *)ptr)[SLAB_MIN_SIZE - 1];
+		if (c != (i == SLAB_COUNT - 1 ? 'x' : 0))
+			printf("ERROR: unexpected slab %d contents\n", i);
+	}
+	for (i = 0; i < SLAB_COUNT; i++)
+		slab_unmap(&arena, slabs[i]);
+
+	/* Trim in background. */
+	slab_arena_set_purge(&arena, 0, 0);
+	if (slab_arena_start_purge_thread(&arena, 0.001) != 0)
+		printf("ERROR: can't start purge thread\n");
+	for (i = 0; i < 1000 && arena.stats.purged < 2 * expected; i++)
+		usleep(1000);
+	if (arena.stats.purged < 2 * expected)
+		printf("ERROR: slabs are not purged in background\n");
+	/* The quota is used up, cached slabs are reused during trim. */
+	for (i = 0; i < 10000; i++) {
+		void *ptr = slab_map(&arena);
+		if (ptr == NULL) {
+			printf("ERROR: cached slabs are missed by trim\n");
+			break;
+		}
+		slab_unmap(&arena, ptr);
+	}
+	slab_arena_stop_purge_thread(&arena);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_batch(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	enum { SLAB_COUNT = 8 };
+	void *slabs[SLAB_COUNT], *more[SLAB_COUNT], *got[SLAB_COUNT];
+	int i;
+
+	/*
+	 * A batch spans the preallocated arena and a new mapping,
+	 * and is limited by the quota.
+	 */
+	quota_init(&quota, SLAB_COUNT * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, 3 * SLAB_MIN_SIZE,
+			  SLAB_MIN_SIZE, SLAB_ARENA_PRIVATE);
+	if (slab_map_batch(&arena, slabs, 4) != 4)
+		printf("ERROR: can't map a batch of new slabs\n");
+	for (i = 0; i < 4; i++) {
+		if ((uintptr_t)slabs[i] % SLAB_MIN_SIZE != 0)
+			printf("ERROR: slab %p is not aligned\n", slabs[i]);
+		memset(slabs[i], 'x', SLAB_MIN_SIZE);
+	}
+	if (slab_map_batch(&arena, more, SLAB_COUNT) != 4)
+		printf("ERROR: batch exceeds the quota\n");
+	if (arena.used != SLAB_COUNT * SLAB_MIN_SIZE)
+		printf("ERROR: unexpected arena->used %zu\n", arena.used);
+
+	/* Cached slabs are reused in the order of slab_unmap(). */
+	slab_unmap_batch(&arena, slabs, 4);
+	slab_unmap(&arena, more[0]);
+	if (slab_map_batch(&arena, got, 3) != 3 || got[0] != more[0] ||
+	    got[1] != slabs[3] || got[2] != slabs[2])
+		printf("ERROR: unexpected order of cached slabs\n");
+	got[3] = slab_map(&arena);
+	if (got[3] != slabs[1])
+		printf("ERROR: unexpected order of cached slabs\n");
+	if (slab_map_batch(&arena, got + 4, SLAB_COUNT) != 1 ||
+	    got[4] != slabs[0])
+		printf("ERROR: unexpected order of cached slabs\n");
+
+	slab_unmap_batch(&arena, got, 5);
+	slab_unmap_batch(&arena, more + 1, 3);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_reserve(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	enum { SLAB_COUNT = 8 };
+	void *slabs[SLAB_COUNT];
+	int i;
+
+	/*
+	 * Slabs beyond prealloc are committed in the reserved
+	 * area, both one by one and in a batch.
+	 */
+	quota_init(&quota, SLAB_COUNT * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, 2 * SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE | SLAB_ARENA_RESERVE);
+	if (arena.reserved != SLAB_COUNT * SLAB_MIN_SIZE)
+		printf("ERROR: unexpected arena->reserved %zu\n",
+		       arena.reserved);
+	for (i = 0; i < 3; i++)
+		slabs[i] = slab_map(&arena);
+	if (slab_map_batch(&arena, slabs + 3, SLAB_COUNT) != SLAB_COUNT - 3)
+		printf("ERROR: can't map a batch of reserved slabs\n");
+	for (i = 0; i < SLAB_COUNT; i++) {
+		if (slabs[i] != (char *)arena.arena + i * SLAB_MIN_SIZE)
+			printf("ERROR: slab %p is not reserved\n", slabs[i]);
+		memset(slabs[i], 'x', SLAB_MIN_SIZE);
+	}
+	if (slab_map(&arena) != NULL)
+		printf("ERROR: slab is mapped beyond the quota\n");
+	slab_unmap_batch(&arena, slabs, SLAB_COUNT);
+
+	/* The quota grown after creation is served by mmap(). */
+	quota_set(&quota, 2 * SLAB_COUNT * SLAB_MIN_SIZE);
+	void *ptr = slab_map_batch(&arena, slabs, SLAB_COUNT) == SLAB_COUNT ?
+		    slab_map(&arena) : NULL;
+	if (ptr == NULL || (ptr >= arena.arena &&
+			    ptr < arena.arena + arena.reserved))
+		printf("ERROR: unexpected slab beyond the reserve\n");
+	else
+		memset(ptr, 'x', SLAB_MIN_SIZE);
+	slab_unmap_batch(&arena, slabs, SLAB_COUNT);
+	slab_unmap(&arena, ptr);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_file(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	enum { SLAB_COUNT = 16, OBJ_COUNT = 1000 };
+	size_t size = SLAB_COUNT * SLAB_MIN_SIZE;
+	struct root {
+		struct slab_cache cache;
+		struct mempool pool;
+		long *objs[OBJ_COUNT];
+	} *root;
+	int i;
+
+	FILE *file = tmpfile();
+	if (file == NULL) {
+		printf("ERROR: can't create a file\n");
+		return;
+	}
+	int fd = fileno(file);
+	/* Find a free address range to place the file at. */
+	char *base = mmap(NULL, size + SLAB_MIN_SIZE, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	munmap(base, size + SLAB_MIN_SIZE);
+	base = (char *)small_align((uintptr_t)base, SLAB_MIN_SIZE);
+
+	quota_init(&quota, size);
+	if (slab_arena_create_file(&arena, &quota, fd, base, size,
+				   SLAB_MIN_SIZE, SLAB_ARENA_SHARED) != 0)
+		printf("ERROR: can't create a file arena\n");
+	if (slab_arena_root(&arena) != NULL)
+		printf("ERROR: new file arena has a root\n");
+	root = slab_map(&arena);
+	slab_cache_create(&root->cache, &arena);
+	mempool_create(&root->pool, &root->cache, sizeof(long));
+	for (i = 0; i < OBJ_COUNT; i++) {
+		root->objs[i] = mempool_alloc(&root->pool);
+		*root->objs[i] = i;
+	}
+	slab_arena_set_root(&arena, root);
+	size_t used = arena.used;
+	/* Keep a cached slab across the restart. */
+	slab_unmap(&arena, slab_map(&arena));
+	slab_arena_destroy(&arena);
+
+	/* The layout of the file must match. */
+	quota_init(&quota, size);
+	if (slab_arena_create_file(&arena, &quota, fd, base,
+				   size - SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+				   SLAB_ARENA_SHARED) == 0 || errno != EINVAL)
+		printf("ERROR: file arena is attached with a wrong size\n");
+
+	/* Restart. */
+	if (slab_arena_create_file(&arena, &quota, fd, base, size,
+				   SLAB_MIN_SIZE, SLAB_ARENA_SHARED) != 0)
+		printf("ERROR: can't attach a file arena\n");
+	if (arena.used != used + SLAB_MIN_SIZE ||
+	    quota_used(&quota) != arena.used)
+		printf("ERROR: unexpected arena->used %zu\n", arena.used);
+	root = slab_arena_root(&arena);
+	if (root != (struct root *)(base + SLAB_MIN_SIZE))
+		printf("ERROR: unexpected root %p\n", root);
+	slab_cache_reattach(&root->cache, &arena);
+	for (i = 0; i < OBJ_COUNT; i++) {
+		if (*root->objs[i] != i)
+			printf("ERROR: object %d is lost\n", i);
+	}
+	for (i = 0; i < OBJ_COUNT; i++)
+		mempool_free(&root->pool, root->objs[i]);
+	if (mempool_count(&root->pool) != 0)
+		printf("ERROR: objects are leaked\n");
+	/* The cached slab is reused. */
+	void *ptr = slab_map(&arena);
+	if (ptr == NULL || arena.used != used + SLAB_MIN_SIZE)
+		printf("ERROR: cached slab is not reused\n");
+	slab_unmap(&arena, ptr);
+	mempool_destroy(&root->pool);
+	slab_cache_destroy(&root->cache);
+	slab_unmap(&arena, root);
+	slab_arena_destroy(&arena);
+	fclose(file);
+}
+
+static void
+slab_test_prefault(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	enum { SLAB_COUNT = 37 };
+	size_t size = SLAB_COUNT * SLAB_MIN_SIZE;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t i, page_count = size / page_size;
+
+	quota_init(&quota, size);
+	slab_arena_create(&arena, &quota, size, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE | SLAB_ARENA_PREFAULT);
+	unsigned char *vec = malloc(page_count);
+	if (mincore(arena.arena, size, vec) != 0) {
+		printf("ERROR: mincore() failed\n");
+	} else {
+		for (i = 0; i < page_count; i++) {
+			if (!(vec[i] & 1)) {
+				printf("ERROR: page %zu is not prefaulted\n",
+				       i);
+				break;
+			}
+		}
+	}
+	free(vec);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_stats(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	struct slab_arena_stats stats;
+	void *slabs[4];
+
+	quota_init(&quota, 4 * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	slab_arena_stats(&arena, &stats);
+	size_t mmap_calls = stats.mmap_calls;
+	slabs[0] = slab_map(&arena);
+	slabs[1] = slab_map(&arena);
+	if (slab_map_batch(&arena, slabs + 2, 3) != 2)
+		printf("ERROR: batch exceeds the quota\n");
+	slab_unmap_batch(&arena, slabs, 3);
+	slabs[0] = slab_map(&arena);
+	slab_arena_stats(&arena, &stats);
+	if (stats.cache_hits != 1 || stats.prealloc_hits != 1 ||
+	    stats.mmap_calls - mmap_calls < 2 || stats.quota_failures != 1 ||
+	    stats.cached != 2 * SLAB_MIN_SIZE ||
+	    stats.misaligned_retries > stats.mmap_calls)
+		printf("ERROR: unexpected arena stats\n");
+	slab_unmap(&arena, slabs[0]);
+	slab_unmap(&arena, slabs[3]);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_thread_cache(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	struct slab_thread_cache cache, other;
+	enum { SLAB_COUNT = 3 * SLAB_MAGAZINE_SIZE + 1 };
+	void *slabs[SLAB_COUNT];
+	int i;
+
+	quota_init(&quota, SLAB_COUNT * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, 0, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	slab_thread_cache_create(&cache, &arena);
+	slab_thread_cache_create(&other, &arena);
+	for (i = 0; i < SLAB_COUNT; i++)
+		slabs[i] = slab_thread_cache_map(&cache);
+	/* Two magazines stay in the cache, two go to the depot. */
+	for (i = 0; i < SLAB_COUNT; i++)
+		slab_thread_cache_unmap(&cache, slabs[i]);
+	if (cache.loaded->count != 1 ||
+	    cache.prev->count != SLAB_MAGAZINE_SIZE)
+		printf("ERROR: unexpected magazines of a thread cache\n");
+	/* Another thread gets the magazine from the depot. */
+	for (i = 0; i < SLAB_MAGAZINE_SIZE; i++) {
+		void *ptr = slab_thread_cache_map(&other);
+		if (ptr != slabs[2 * SLAB_MAGAZINE_SIZE - 1 - i])
+			printf("ERROR: unexpected slab from the depot\n");
+		slabs[i] = ptr;
+	}
+	if (!lf_lifo_is_empty(&arena.cache))
+		printf("ERROR: the arena is used by a thread cache\n");
+	for (i = 0; i < SLAB_MAGAZINE_SIZE; i++)
+		slab_thread_cache_unmap(&other, slabs[i]);
+	slab_thread_cache_destroy(&other);
+	slab_thread_cache_destroy(&cache);
+	/* The arena takes the magazine left in the depot. */
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_depot(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	struct slab_thread_cache cache;
+	enum { SLAB_COUNT = (SLAB_DEPOT_MAX + 3) * SLAB_MAGAZINE_SIZE };
+	static void *slabs[SLAB_COUNT];
+	int i;
+
+	quota_init(&quota, SLAB_COUNT * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, 0, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	slab_thread_cache_create(&cache, &arena);
+	for (i = 0; i < SLAB_COUNT; i++)
+		slabs[i] = slab_thread_cache_map(&cache);
+	/* The magazine which doesn't fit the depot goes to the cache. */
+	for (i = 0; i < SLAB_COUNT; i++)
+		slab_thread_cache_unmap(&cache, slabs[i]);
+	if (arena.depot_size != SLAB_DEPOT_MAX ||
+	    arena.stats.cached != SLAB_MAGAZINE_SIZE * SLAB_MIN_SIZE)
+		printf("ERROR: the depot is not bounded\n");
+	/* The quota is used up, the arena takes slabs from the depot. */
+	size_t count = SLAB_COUNT - 2 * SLAB_MAGAZINE_SIZE;
+	if (slab_map_batch(&arena, slabs, count - 1) != count - 1 ||
+	    (slabs[count - 1] = slab_map(&arena)) == NULL ||
+	    arena.depot_size != 0 || arena.stats.quota_failures != 0)
+		printf("ERROR: slabs in the depot are not reused\n");
+	slab_unmap_batch(&arena, slabs, count);
+	slab_thread_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_dontfork(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	quota_init(&quota, 2 * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE | SLAB_ARENA_DONTFORK);
+	char *ptr = slab_map(&arena);
+	memset(ptr, 'x', SLAB_MIN_SIZE);
+	slab_unmap(&arena, ptr);
+	if (!vma_has_flag((unsigned long)ptr + page_size, "dc"))
+		printf("ERROR: cached slab is copied on fork\n");
+
+	/* The child sees the header of a cached slab. */
+	pid_t pid = fork();
+	if (pid == 0)
+		_exit(ptr[page_size - 1] == 'x' ? 0 : 1);
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		printf("ERROR: cached slab header is lost on fork\n");
+
+	if (slab_map(&arena) != ptr ||
+	    vma_has_flag((unsigned long)ptr + page_size, "dc"))
+		printf("ERROR: reused slab is not copied on fork\n");
+	slab_unmap(&arena, ptr);
+
+	/* A free slab kept by a slab cache is excluded too. */
+	struct slab_cache cache;
+	slab_cache_create(&cache, &arena);
+	struct slab *slab = slab_get_with_order(&cache, cache.order_max);
+	if (slab != (struct slab *)ptr)
+		printf("ERROR: cached slab is not reused\n");
+	slab_put_with_order(&cache, slab);
+	if (!vma_has_flag((unsigned long)slab + page_size, "dc"))
+		printf("ERROR: free slab is copied on fork\n");
+	slab = slab_get_with_order(&cache, 0);
+	if (vma_has_flag((unsigned long)ptr + page_size, "dc"))
+		printf("ERROR: used slab is not copied on fork\n");
+	slab_put_with_order(&cache, slab);
+	slab_cache_destroy(&cache);
+	if (arena.stats.fork_advise_failures != 0)
+		printf("ERROR: fork advice failed\n");
+	slab_arena_destroy(&arena);
+}
+
+static void
+slab_test_shrink(void)
+{
+	struct slab_arena arena;
+	struct quota quota;
+	struct slab_cache cache;
+	void *slabs[4];
+	int i;
+
+	quota_init(&quota, 4 * SLAB_MIN_SIZE);
+	slab_arena_create(&arena, &quota, 2 * SLAB_MIN_SIZE, SLAB_MIN_SIZE,
+			  SLAB_ARENA_PRIVATE);
+	slab_cache_create(&cache, &arena);
+	slab_arena_add_shrinker(&arena, &cache.shrinker);
+	for (i = 0; i < 4; i++)
+		slabs[i] = slab_map(&arena);
+	slab_unmap_batch(&arena, slabs, 4);
+	/* The slab cache keeps one free slab. */
+	struct slab *slab1 = slab_get_with_order(&cache, cache.order_max);
+	struct slab *slab2 = slab_get_with_order(&cache, cache.order_max);
+	slab_put_with_order(&cache, slab1);
+	slab_put_with_order(&cache, slab2);
+	if (rlist_empty(&cache.orders[cache.order_max].slabs))
+		printf("ERROR: slab cache has no free slabs\n");
+
+	/* The cache returns its free slabs in the owner thread. */
+	if (slab_arena_shrink(&arena, 0) != SLAB_MIN_SIZE ||
+	    rlist_empty(&cache.orders[cache.order_max].slabs))
+		printf("ERROR: slab cache is shrunk by another thread\n");
+	slab_cache_drain_remote(&cache);
+	if (slab_arena_shrink(&arena, SLAB_MIN_SIZE) != 0 ||
+	    quota_total(&quota) != SLAB_MIN_SIZE ||
+	    quota_used(&quota) != SLAB_MIN_SIZE)
+		printf("ERROR: arena is not shrunk\n");
+	if (!rlist_empty(&cache.orders[cache.order_max].slabs))
+		printf("ERROR: slab cache is not shrunk\n");
+	slabs[0] = slab_map(&arena);
+	if (slabs[0] == NULL || slab_map(&arena) != NULL)
+		printf("ERROR: shrunk limit is not respected\n");
+
+	/* Reclaimed slabs are mapped again. */
+	quota_set(&quota, 4 * SLAB_MIN_SIZE);
+	for (i = 1; i < 4; i++) {
+		slabs[i] = slab_map(&arena);
+		if (slabs[i] == NULL)
+			printf("ERROR: reclaimed slab is not reused\n");
+		memset(slabs[i], 'x', SLAB_MIN_SIZE);
+	}
+	if (slab_arena_shrink(&arena, 2 * SLAB_MIN_SIZE) !=
+	    2 * SLAB_MIN_SIZE || quota_total(&quota) != 4 * SLAB_MIN_SIZE)
+		printf("ERROR: used slabs are reclaimed\n");
+	slab_unmap_batch(&arena, slabs, 4);
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+}
+
 int main()
 {
 	struct quota quota;
@@ -172,4 +805,16 @@ int main()
 	slab_arena_destroy(&arena);
 
 	slab_test_madvise();
+	slab_test_hugepage();
+	slab_test_numa();
+	slab_test_purge();
+	slab_test_batch();
+	slab_test_reserve();
+	slab_test_file();
+	slab_test_prefault();
+	slab_test_stats();
+	slab_test_thread_cache();
+	slab_test_depot();
+	slab_test_dontfork();
+	slab_test_shrink();
 }
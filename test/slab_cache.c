@@ -1,9 +1,14 @@
 #include <small/slab_cache.h>
 #include <small/quota.h>
+#include <small/util.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "unit.h"
 
 struct quota quota;
@@ -45,9 +50,11 @@ test_slab_cache(void)
 	/*
 	 * It is allowed to hold only one slab of arena.
 	 * If at lest one block was allocated then after freeing
-	 * all memory it must be exactly one slab.
+	 * all memory it must be exactly one slab, not counting
+	 * the retained large slabs.
 	 */
-	if (cache.allocated.stats.total != arena.slab_size) {
+	if (cache.allocated.stats.total - cache.large_free.stats.total !=
+	    arena.slab_size) {
 		fail("Slab cache returned memory to arena", "false");
 	}
 
@@ -69,7 +76,446 @@ test_slab_real_size(void)
 	fail_unless(slab_real_size(&cache, 0) == cache.order0_size);
 	fail_unless(slab_real_size(&cache, MB - slab_sizeof()) == MB);
 	fail_unless(slab_real_size(&cache, MB - slab_sizeof() + 1) == 2 * MB);
-	fail_unless(slab_real_size(&cache, 4564477 - slab_sizeof()) == 4564477);
+	fail_unless(slab_real_size(&cache, 4564477 - slab_sizeof()) ==
+		    small_align(4564477, small_getpagesize()));
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_cache_refill(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+
+	/* Arena slabs are mapped one by one by default. */
+	int i;
+	for (i = 0; i < NRUNS; i++) {
+		runs[i] = slab_get_with_order(&cache, cache.order_max);
+		fail_unless(runs[i]);
+	}
+	fail_unless(cache.refill_batch == 1);
+	for (i = 0; i < NRUNS; i++) {
+		slab_put(&cache, runs[i]);
+		runs[i] = NULL;
+	}
+
+	/* A growing cache maps arena slabs in batches on request. */
+	slab_cache_set_refill_max(&cache, SLAB_CACHE_REFILL_MAX);
+	for (i = 0; i < NRUNS; i++) {
+		runs[i] = slab_get_with_order(&cache, cache.order_max);
+		fail_unless(runs[i]);
+	}
+	fail_unless(cache.refill_batch == SLAB_CACHE_REFILL_MAX);
+	fail_unless(cache.allocated.stats.total >= NRUNS * arena.slab_size);
+	slab_cache_check(&cache);
+
+	/* A shrinking cache keeps only one free arena slab. */
+	for (i = 0; i < NRUNS; i++) {
+		slab_put(&cache, runs[i]);
+		runs[i] = NULL;
+	}
+	slab_cache_check(&cache);
+	fail_unless(cache.refill_batch == 1);
+	fail_unless(cache.allocated.stats.total == arena.slab_size);
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_realloc(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+
+	/* Shrinking gives the upper halves back. */
+	size_t size = cache.order0_size - slab_sizeof();
+	struct slab *slab = slab_get_with_order(&cache, cache.order_max - 1);
+	fail_unless(slab);
+	memset(slab_data(slab), 'x', size);
+	fail_unless(slab_realloc(&cache, slab, size) == slab);
+	fail_unless(slab->order == 0);
+	fail_unless(((char *)slab_data(slab))[size - 1] == 'x');
+	slab_cache_check(&cache);
+
+	/* A slab with free buddies grows in place. */
+	struct slab *grown = slab_realloc(&cache, slab, 4 * size);
+	fail_unless(grown == slab);
+	fail_unless(slab->order == 2);
+	fail_unless(((char *)slab_data(slab))[size - 1] == 'x');
+	slab_cache_check(&cache);
+	fail_unless(slab_realloc(&cache, slab, size) == slab);
+	fail_unless(slab->order == 0);
+
+	/* A busy buddy prevents growing in place. */
+	struct slab *buddy = slab_get(&cache, size);
+	fail_unless(buddy == (struct slab *)((char *)slab + slab->size));
+	fail_unless(slab_realloc(&cache, slab, 2 * size) == NULL);
+	fail_unless(slab->order == 0);
+	slab_cache_check(&cache);
+	slab_put(&cache, buddy);
+
+	/* An ordered slab doesn't turn into a large one. */
+	fail_unless(slab_realloc(&cache, slab, MAX_ALLOC) == NULL);
+	slab_put(&cache, slab);
+
+	/* Large slabs are realloc()-ed. */
+	slab = slab_get(&cache, MAX_ALLOC);
+	fail_unless(slab);
+	slab = slab_realloc(&cache, slab, 2 * MAX_ALLOC);
+	fail_unless(slab);
+	fail_unless(slab->size == slab_real_size(&cache, 2 * MAX_ALLOC));
+	slab_cache_check(&cache);
+	fail_unless(slab_realloc(&cache, slab, size) == NULL);
+	slab_put(&cache, slab);
+	slab_cache_check(&cache);
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_buddy_bitmap(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+
+	struct slab *slabs[4];
+	int i;
+	for (i = 0; i < 4; i++) {
+		slabs[i] = slab_get_with_order(&cache, 0);
+		fail_unless(slabs[i]);
+	}
+	fail_unless(slabs[1] == (struct slab *)((char *)slabs[0] +
+						cache.order0_size));
+	/*
+	 * Merging a slab with a free buddy must not touch
+	 * the memory of the buddy.
+	 */
+	slab_put(&cache, slabs[0]);
+	fail_unless(mprotect(slabs[0], cache.order0_size, PROT_NONE) == 0);
+	slab_put(&cache, slabs[1]);
+	fail_unless(mprotect(slabs[0], cache.order0_size,
+			     PROT_READ | PROT_WRITE) == 0);
+	slab_cache_check(&cache);
+	fail_unless(cache.orders[1].stats.total != 0);
+
+	/* The arena slab is whole again once all slabs are put. */
+	slab_put(&cache, slabs[2]);
+	slab_put(&cache, slabs[3]);
+	slab_cache_check(&cache);
+	fail_unless(cache.allocated.stats.used == 0);
+	for (i = 0; i < cache.order_max; i++)
+		fail_unless(cache.orders[i].stats.total == 0);
+	fail_unless(!rlist_empty(&cache.orders[cache.order_max].slabs));
+
+	/*
+	 * The first arena slab keeps the metadata in its upper
+	 * half, both halves of the next one are usable.
+	 */
+	for (i = 0; i < 3; i++) {
+		slabs[i] = slab_get_with_order(&cache, cache.order_max - 1);
+		fail_unless(slabs[i]);
+	}
+	fail_unless(slabs[2] == (struct slab *)((char *)slabs[1] +
+						slabs[1]->size));
+	fail_unless(cache.meta_slabs == 1);
+	slab_cache_check(&cache);
+	for (i = 0; i < 3; i++)
+		slab_put(&cache, slabs[i]);
+	slab_cache_check(&cache);
+	fail_unless(cache.meta_slabs == 0);
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_large(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+	size_t quota_before = quota_used(&quota);
+
+	/* Freed large slabs are retained ... */
+	struct slab *slab = slab_get_large(&cache, 2 * MAX_ALLOC);
+	fail_unless(slab);
+	fail_unless(slab->size % small_getpagesize() == 0);
+	size_t size = slab->size;
+	slab_put(&cache, slab);
+	fail_unless(cache.large_free.stats.total == size);
+	fail_unless(cache.allocated.stats.used == 0);
+	slab_cache_check(&cache);
+
+	/* ... and reused, giving the excess pages back. */
+	struct slab *reused = slab_get_large(&cache, MAX_ALLOC);
+	fail_unless(reused == slab);
+	fail_unless(reused->size == slab_real_size(&cache, MAX_ALLOC));
+	fail_unless(cache.large_free.stats.total == 0);
+	fail_unless(quota_used(&quota) - quota_before ==
+		    quota_align(reused->size));
+	slab_cache_check(&cache);
+
+	/* Only a few free large slabs are kept. */
+	struct slab *slabs[SLAB_CACHE_LARGE_RETAIN_MAX + 1];
+	int i;
+	for (i = 0; i < SLAB_CACHE_LARGE_RETAIN_MAX + 1; i++) {
+		slabs[i] = slab_get_large(&cache, MAX_ALLOC);
+		fail_unless(slabs[i]);
+	}
+	for (i = 0; i < SLAB_CACHE_LARGE_RETAIN_MAX + 1; i++)
+		slab_put(&cache, slabs[i]);
+	fail_unless(cache.large_free.stats.total ==
+		    SLAB_CACHE_LARGE_RETAIN_MAX * reused->size);
+	slab_cache_check(&cache);
+
+	/* Shrink unmaps them. */
+	slab_put(&cache, reused);
+	slab_cache_shrink(&cache);
+	fail_unless(cache.large_free.stats.total == 0);
+	fail_unless(quota_used(&quota) == quota_before);
+	slab_cache_check(&cache);
+
+	/* So does an arena slab refill which runs out of quota. */
+	for (i = 0; i < SLAB_CACHE_LARGE_RETAIN_MAX; i++) {
+		slabs[i] = slab_get_large(&cache, MAX_ALLOC);
+		fail_unless(slabs[i]);
+	}
+	for (i = 0; i < SLAB_CACHE_LARGE_RETAIN_MAX; i++)
+		slab_put(&cache, slabs[i]);
+	size_t total = quota_total(&quota);
+	quota_set(&quota, quota_used(&quota));
+	slab = slab_get_with_order(&cache, cache.order_max);
+	fail_unless(slab);
+	fail_unless(cache.large_free.stats.total == 0);
+	slab_cache_check(&cache);
+	slab_put(&cache, slab);
+	quota_set(&quota, total);
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_retention(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+	uint8_t order = cache.order_max;
+
+	struct slab_cache_retention retention = {
+		.min_retained = 2,
+		.max_retained = 4 * arena.slab_size,
+		.decay = 0,
+	};
+	slab_cache_set_retention(&cache, &retention);
+	int i;
+	for (i = 0; i < NRUNS; i++) {
+		runs[i] = slab_get_with_order(&cache, order);
+		fail_unless(runs[i]);
+	}
+	for (i = 0; i < NRUNS; i++)
+		slab_put(&cache, runs[i]);
+	fail_unless(cache.retained == 4);
+	slab_cache_check(&cache);
+
+	/* Retained slabs are reused. */
+	struct slab_cache_counters counters = cache.counters[order];
+	for (i = 0; i < 4; i++)
+		runs[i] = slab_get_with_order(&cache, order);
+	fail_unless(cache.counters[order].hits == counters.hits + 4);
+	fail_unless(cache.counters[order].misses == counters.misses);
+	for (i = 0; i < 4; i++)
+		slab_put(&cache, runs[i]);
+
+	/* Slabs not reused for the decay period are returned. */
+	retention.min_retained = 1;
+	retention.max_retained = 8 * arena.slab_size;
+	retention.decay = 0.01;
+	slab_cache_set_retention(&cache, &retention);
+	fail_unless(cache.retained == 4);
+	struct slab *slab = slab_get_with_order(&cache, order);
+	fail_unless(cache.retained == 3);
+	usleep(20000);
+	slab_put(&cache, slab);
+	fail_unless(cache.retained == 1);
+	slab_cache_check(&cache);
+
+	/* So do they in a cache which only allocates. */
+	runs[0] = slab_get_with_order(&cache, 0);
+	for (i = 1; i < 4; i++)
+		runs[i] = slab_get_with_order(&cache, order);
+	for (i = 1; i < 4; i++)
+		slab_put(&cache, runs[i]);
+	fail_unless(cache.retained == 3);
+	usleep(20000);
+	runs[1] = slab_get_with_order(&cache, 0);
+	fail_unless(cache.retained == 3);
+	usleep(20000);
+	runs[2] = slab_get_with_order(&cache, 0);
+	fail_unless(cache.retained == 1);
+	for (i = 0; i < 3; i++)
+		slab_put(&cache, runs[i]);
+	slab_cache_check(&cache);
+
+	for (i = 0; i < NRUNS; i++)
+		runs[i] = NULL;
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_stats(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+
+	struct slab_cache_stats stats;
+	slab_cache_stats(&cache, &stats);
+	fail_unless(stats.order_count == cache.order_max + 1);
+	fail_unless(stats.largest_free_order == -1);
+
+	struct slab *slab = slab_get_with_order(&cache, 0);
+	fail_unless(slab);
+	slab_cache_stats(&cache, &stats);
+	fail_unless(stats.orders[0].used == 1);
+	fail_unless(stats.orders[0].counters.misses == 1);
+	fail_unless(stats.orders[cache.order_max].counters.splits == 1);
+	/* The upper half keeps the metadata, the lower one is whole. */
+	fail_unless(stats.largest_free_order == cache.order_max - 1);
+	/* All memory is either free, used or the buddy metadata. */
+	fail_unless(cache.meta_slabs == 1);
+	size_t total = slab_order_size(&cache, cache.meta_order);
+	int i;
+	for (i = 0; i < stats.order_count; i++) {
+		total += (stats.orders[i].free + stats.orders[i].used) *
+			 slab_order_size(&cache, i);
+		fail_unless(stats.orders[i].counters.merges == 0);
+	}
+	fail_unless(total == cache.allocated.stats.total);
+
+	slab_put(&cache, slab);
+	slab_cache_stats(&cache, &stats);
+	fail_unless(stats.orders[0].used == 0);
+	fail_unless(stats.largest_free_order == cache.order_max);
+	fail_unless(stats.orders[cache.order_max].free == 1);
+	/* Each split has been undone by a merge. */
+	for (i = 0; i < cache.order_max; i++) {
+		fail_unless(stats.orders[i].free == 0);
+		fail_unless(stats.orders[i].counters.merges ==
+			    stats.orders[i + 1].counters.splits);
+	}
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void *
+put_remote_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < NRUNS; i++)
+		slab_put_remote(&cache, runs[i]);
+	return NULL;
+}
+
+static void
+test_slab_put_remote(void)
+{
+	header();
+
+	slab_arena_create(&arena, &quota, 0, 4000000, MAP_PRIVATE);
+	slab_cache_create(&cache, &arena);
+
+	int i;
+	for (i = 0; i < NRUNS; i++) {
+		size_t size = i % 2 == 0 ? cache.order0_size : MAX_ALLOC;
+		runs[i] = slab_get(&cache, size);
+		fail_unless(runs[i]);
+	}
+	size_t used = cache.allocated.stats.used;
+
+	/* Slabs freed by another thread stay queued ... */
+	pthread_t thread;
+	fail_unless(pthread_create(&thread, NULL, put_remote_f, NULL) == 0);
+	fail_unless(pthread_join(thread, NULL) == 0);
+	fail_unless(cache.remote_free != NULL);
+	fail_unless(cache.allocated.stats.used == used);
+
+	/* ... until the owner allocates. */
+	struct slab *slab = slab_get_with_order(&cache, 0);
+	fail_unless(slab);
+	fail_unless(cache.remote_free == NULL);
+	fail_unless(cache.allocated.stats.used == slab->size);
+	slab_cache_check(&cache);
+
+	slab_put(&cache, slab);
+	for (i = 0; i < NRUNS; i++)
+		runs[i] = NULL;
+
+	slab_cache_destroy(&cache);
+	slab_arena_destroy(&arena);
+
+	footer();
+}
+
+static void
+test_slab_quota_one_slab(void)
+{
+	header();
+
+	/* The buddy metadata fits in a single arena slab. */
+	struct quota one_slab;
+	quota_init(&one_slab, 4 * 1024 * 1024);
+	slab_arena_create(&arena, &one_slab, 0, 4 * 1024 * 1024, MAP_PRIVATE);
+	fail_unless(arena.slab_size == quota_total(&one_slab));
+	slab_cache_create(&cache, &arena);
+
+	struct slab *slab = slab_get_with_order(&cache, 0);
+	fail_unless(slab);
+	struct slab *half = slab_get_with_order(&cache, cache.order_max - 1);
+	fail_unless(half);
+	fail_unless(slab_get_with_order(&cache, cache.order_max) == NULL);
+	fail_unless(cache.meta_slabs == 1);
+	slab_cache_check(&cache);
+
+	/* The arena slab is whole again along with its metadata. */
+	slab_put(&cache, slab);
+	slab_put(&cache, half);
+	slab_cache_check(&cache);
+	fail_unless(cache.meta_slabs == 0);
+	fail_unless(cache.allocated.stats.total == arena.slab_size);
+	slab = slab_get_with_order(&cache, cache.order_max);
+	fail_unless(slab);
+	slab_put(&cache, slab);
 
 	slab_cache_destroy(&cache);
 	slab_arena_destroy(&arena);
@@ -85,6 +531,14 @@ main(void)
 
 	test_slab_cache();
 	test_slab_real_size();
+	test_slab_cache_refill();
+	test_slab_put_remote();
+	test_slab_realloc();
+	test_slab_buddy_bitmap();
+	test_slab_large();
+	test_slab_retention();
+	test_slab_stats();
+	test_slab_quota_one_slab();
 
 	return 0;
 }